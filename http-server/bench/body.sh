@@ -0,0 +1,38 @@
+#!/bin/sh
+# Request body throughput of each server as the body grows from 1 KB to
+# 100 MB. Runs every server once per size and prints the MB/s of body
+# uploaded and echoed back, as reported by body_bench. Any extra arguments
+# go to body_bench, e.g. -k 16K to send the bodies chunked.
+#
+# usage: ./body.sh [seconds] [body_bench options]
+
+DURATION=${1:-5}
+[ $# -gt 0 ] && shift
+PORT=8290
+
+# usage: run port size server [server options]
+run() {
+    port=$1
+    size=$2
+    shift 2
+    "$@" $port > /dev/null &
+    pid=$!
+    sleep 0.5
+    ./body_bench -d $DURATION -s $size $BENCH_OPTS $port | awk '/upload\/s/ { print $2 }'
+    kill $pid
+    wait $pid 2> /dev/null
+}
+
+BENCH_OPTS="$*"
+printf "%6s %14s %14s %14s %14s %14s\n" "size" "io-uring" "io-uring -b" "multi-process" "thread-pool" "epoll"
+for size in 1K 64K 1M 16M 100M; do
+    # A killed io_uring server releases its port only once the ring is torn
+    # down, so every run gets a fresh port
+    PORT=$((PORT + 5))
+    uring=$(run $PORT $size ../io-uring/server)
+    bufring=$(run $((PORT + 1)) $size ../io-uring/server -b)
+    mp=$(run $((PORT + 2)) $size ../multi-process/server)
+    tp=$(run $((PORT + 3)) $size ../thread-pool/server)
+    ep=$(run $((PORT + 4)) $size ../epoll/server)
+    printf "%6s %14s %14s %14s %14s %14s\n" $size "$uring" "$bufring" "$mp" "$tp" "$ep"
+done
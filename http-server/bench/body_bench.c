@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include "picohttpparser.h"
+
+/*
+ * Request body throughput. Every connection POSTs bodies of one size to
+ * /echo over keep-alive and reads the echo while the body is still going
+ * out, so neither side's socket buffers fill up; the next body goes out
+ * once the whole echo is in. Reports requests/s, body bytes per second in
+ * each direction and latency percentiles. With -k the body is sent with
+ * chunked transfer coding in chunks of the given size, and the server
+ * echoes it chunked.
+ *
+ *   for s in 1K 64K 1M 16M 100M; do ./body_bench -s $s 8000; done
+ */
+
+#define DEFAULT_SERVER_PORT     8000
+#define BUF_SZ                  65536
+#define MAX_EVENTS              256
+
+enum {
+    SEND_HEAD,
+    SEND_BODY,
+    SEND_DONE,
+};
+
+enum {
+    RECV_HEADER,
+    RECV_BODY,
+};
+
+struct client {
+    int sock;
+    bool want_out;
+    struct timespec sent;
+    /* request still to be sent: the part of sbuf from soff, then what fill_request generates */
+    int send_state;
+    long long body_left, chunk_left;
+    int slen, soff;
+    char sbuf[BUF_SZ];
+    /* response */
+    int recv_state;
+    bool chunked;
+    long long resp_left;
+    struct phr_chunked_decoder decoder;
+    int rlen;
+    char rbuf[BUF_SZ];
+};
+
+static struct sockaddr_in addr;
+static long long body_size = 1024;
+static long long chunk_size;
+static int epoll_fd;
+static char pattern[BUF_SZ];
+
+static long *latency;
+static unsigned long nr_latency, max_latency;
+static unsigned long responses, errors;
+static unsigned long long bytes_out, bytes_in;
+
+static long elapsed_us(struct timespec *a, struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) * 1000000L + (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+/* A size in bytes, with an optional K, M or G suffix */
+static long long parse_size(const char *s)
+{
+    char *end;
+    long long size = strtoll(s, &end, 10);
+
+    switch (*end) {
+    case 'K': case 'k':
+        size <<= 10;
+        end++;
+        break;
+    case 'M': case 'm':
+        size <<= 20;
+        end++;
+        break;
+    case 'G': case 'g':
+        size <<= 30;
+        end++;
+        break;
+    }
+    return *end || size < 0 ? -1 : size;
+}
+
+/* Generate the next part of the request into sbuf; body bytes count as sent from here */
+static void fill_request(struct client *c)
+{
+    c->slen = c->soff = 0;
+
+    while (c->send_state != SEND_DONE && BUF_SZ - c->slen >= 64) {
+        int room = BUF_SZ - c->slen - 32;
+
+        if (c->send_state == SEND_HEAD) {
+            c->slen += snprintf(c->sbuf + c->slen, room,
+                                "POST /echo HTTP/1.1\r\nHost: localhost\r\n"
+                                "Content-Type: application/octet-stream\r\n");
+            if (chunk_size)
+                c->slen += snprintf(c->sbuf + c->slen, room, "Transfer-Encoding: chunked\r\n\r\n");
+            else
+                c->slen += snprintf(c->sbuf + c->slen, room, "Content-Length: %lld\r\n\r\n", body_size);
+            c->body_left = body_size;
+            c->chunk_left = 0;
+            c->send_state = SEND_BODY;
+            continue;
+        }
+
+        if (chunk_size && c->chunk_left == 0) {
+            if (c->body_left == 0) {
+                c->slen += snprintf(c->sbuf + c->slen, room, "0\r\n\r\n");
+                c->send_state = SEND_DONE;
+                break;
+            }
+            c->chunk_left = c->body_left < chunk_size ? c->body_left : chunk_size;
+            c->slen += snprintf(c->sbuf + c->slen, room, "%llx\r\n", c->chunk_left);
+            room = BUF_SZ - c->slen - 32;
+        }
+
+        long long left = chunk_size ? c->chunk_left : c->body_left;
+        int n = left < room ? left : room;
+        memcpy(c->sbuf + c->slen, pattern, n);
+        c->slen += n;
+        c->body_left -= n;
+        bytes_out += n;
+
+        if (chunk_size) {
+            c->chunk_left -= n;
+            if (c->chunk_left == 0)
+                c->slen += snprintf(c->sbuf + c->slen, 32, "\r\n");
+        } else if (c->body_left == 0) {
+            c->send_state = SEND_DONE;
+        }
+    }
+}
+
+static void watch_writable(struct client *c, bool want_out)
+{
+    if (c->want_out == want_out)
+        return;
+
+    uint32_t events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->sock, &(struct epoll_event){.events = events, .data.ptr = c});
+    c->want_out = want_out;
+}
+
+/* Returns -1 on a socket error */
+static int send_request(struct client *c)
+{
+    while (1) {
+        if (c->soff == c->slen) {
+            if (c->send_state == SEND_DONE) {
+                watch_writable(c, false);
+                return 0;
+            }
+            fill_request(c);
+        }
+
+        ssize_t ret = send(c->sock, c->sbuf + c->soff, c->slen - c->soff, MSG_DONTWAIT);
+        if (ret < 0) {
+            if (errno != EAGAIN)
+                return -1;
+            watch_writable(c, true);
+            return 0;
+        }
+        c->soff += ret;
+    }
+}
+
+static int start_request(struct client *c)
+{
+    clock_gettime(CLOCK_MONOTONIC, &c->sent);
+    c->send_state = SEND_HEAD;
+    c->slen = c->soff = 0;
+    c->recv_state = RECV_HEADER;
+    return send_request(c);
+}
+
+static void connect_client(struct client *c)
+{
+    c->sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->sock < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+    if (connect(c->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+
+    c->want_out = false;
+    c->rlen = 0;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->sock, &(struct epoll_event){.events = EPOLLIN, .data.ptr = c});
+    if (start_request(c) < 0) {
+        perror("send");
+        exit(1);
+    }
+}
+
+static void reconnect_client(struct client *c)
+{
+    errors++;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->sock, NULL);
+    close(c->sock);
+    connect_client(c);
+}
+
+static int complete_response(struct client *c)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (nr_latency == max_latency) {
+        max_latency = max_latency ? max_latency * 2 : 4096;
+        latency = realloc(latency, max_latency * sizeof(*latency));
+    }
+    latency[nr_latency++] = elapsed_us(&c->sent, &now);
+    responses++;
+
+    /* The whole echo is in, so the whole body has gone out */
+    return start_request(c);
+}
+
+/* Returns -1 if the response is malformed */
+static int parse_header(struct client *c, int header_len)
+{
+    if (c->rlen < 12 || memcmp(c->rbuf, "HTTP/1.1 200", 12) != 0)
+        return -1;
+
+    c->chunked = false;
+    c->resp_left = 0;
+    for (char *p = c->rbuf; p < c->rbuf + header_len; p++) {
+        if (*p != '\n')
+            continue;
+        if (strncasecmp(p + 1, "Content-Length:", 15) == 0)
+            c->resp_left = atoll(p + 16);
+        else if (strncasecmp(p + 1, "Transfer-Encoding: chunked", 26) == 0)
+            c->chunked = true;
+    }
+
+    if (c->chunked) {
+        memset(&c->decoder, 0, sizeof(c->decoder));
+        c->decoder.consume_trailer = 1;
+    }
+    return 0;
+}
+
+/* Returns -1 on a malformed response or a socket error */
+static int consume(struct client *c)
+{
+    while (c->rlen > 0 || (c->recv_state == RECV_BODY && !c->chunked && c->resp_left == 0)) {
+        if (c->recv_state == RECV_HEADER) {
+            char *end = memmem(c->rbuf, c->rlen, "\r\n\r\n", 4);
+            if (!end)
+                return c->rlen == BUF_SZ ? -1 : 0;
+
+            int header_len = end + 4 - c->rbuf;
+            if (parse_header(c, header_len) < 0)
+                return -1;
+
+            c->rlen -= header_len;
+            memmove(c->rbuf, c->rbuf + header_len, c->rlen);
+            c->recv_state = RECV_BODY;
+            continue;
+        }
+
+        bool done;
+        if (c->chunked) {
+            size_t n = c->rlen;
+            ssize_t ret = phr_decode_chunked(&c->decoder, c->rbuf, &n);
+            if (ret == -1)
+                return -1;
+            bytes_in += n;
+            done = ret >= 0;
+            c->rlen = done ? ret : 0;
+            memmove(c->rbuf, c->rbuf + n, c->rlen);
+        } else {
+            long long take = c->resp_left < c->rlen ? c->resp_left : c->rlen;
+            c->resp_left -= take;
+            c->rlen -= take;
+            bytes_in += take;
+            memmove(c->rbuf, c->rbuf + take, c->rlen);
+            done = c->resp_left == 0;
+        }
+
+        if (!done)
+            return 0;
+        if (complete_response(c) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static long percentile(double p)
+{
+    return nr_latency ? latency[(unsigned long)(nr_latency * p)] : 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-a addr] [-c conns] [-d seconds] [-s size] [-k chunk] [port]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int conns = 1, duration = 5, port = DEFAULT_SERVER_PORT;
+    const char *host = "127.0.0.1";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:c:d:s:k:")) != -1) {
+        switch (opt) {
+        case 'a':
+            host = optarg;
+            break;
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 's':
+            body_size = parse_size(optarg);
+            if (body_size < 0)
+                usage(argv[0]);
+            break;
+        case 'k':
+            chunk_size = parse_size(optarg);
+            if (chunk_size <= 0)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind < argc)
+        port = atoi(argv[optind]);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+        usage(argv[0]);
+
+    for (int i = 0; i < BUF_SZ; i++)
+        pattern[i] = 'a' + i % 26;
+
+    struct client *clients = calloc(conns, sizeof(*clients));
+    epoll_fd = epoll_create1(0);
+
+    struct timespec start, now;
+    struct epoll_event ev[MAX_EVENTS];
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < conns; i++)
+        connect_client(&clients[i]);
+
+    do {
+        int n = epoll_wait(epoll_fd, ev, MAX_EVENTS, 100);
+        for (int i = 0; i < n; i++) {
+            struct client *c = ev[i].data.ptr;
+
+            if ((ev[i].events & EPOLLOUT) && send_request(c) < 0) {
+                reconnect_client(c);
+                continue;
+            }
+            if (!(ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+                continue;
+
+            ssize_t ret = recv(c->sock, c->rbuf + c->rlen, BUF_SZ - c->rlen, 0);
+            if (ret <= 0) {
+                reconnect_client(c);
+                continue;
+            }
+
+            c->rlen += ret;
+            if (consume(c) < 0)
+                reconnect_client(c);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (elapsed_us(&start, &now) < duration * 1000000L);
+
+    qsort(latency, nr_latency, sizeof(*latency), cmp_long);
+
+    double secs = elapsed_us(&start, &now) / 1e6;
+    printf("body size:      %lld bytes%s\n", body_size, chunk_size ? ", chunked" : "");
+    printf("requests:       %lu\n", responses);
+    printf("errors:         %lu\n", errors);
+    printf("requests/s:     %.1f\n", responses / secs);
+    printf("upload/s:       %.2f MB\n", bytes_out / secs / (1 << 20));
+    printf("echo/s:         %.2f MB\n", bytes_in / secs / (1 << 20));
+    printf("latency p50:    %ld us\n", percentile(0.50));
+    printf("latency p99:    %ld us\n", percentile(0.99));
+
+    for (int i = 0; i < conns; i++)
+        close(clients[i].sock);
+    return 0;
+}
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+/*
+ * Closed-loop HTTP/1.1 load generator. Every connection keeps a batch of
+ * pipelined requests outstanding over keep-alive (one by default) and sends
+ * the next batch as soon as all of its responses have been fully read.
+ * Reports throughput and latency percentiles; a response's latency runs
+ * from the send of its batch. With -C every request goes out on a fresh
+ * connection that the server is asked to close, to measure connection setup.
+ */
+
+#define DEFAULT_SERVER_PORT     8000
+#define RBUF_SZ                 65536
+#define MAX_EVENTS              256
+#define MAX_DEPTH               1024
+
+/* Latency histogram with 1 us buckets, the last one collects everything above */
+#define LAT_BUCKETS             1000000
+
+enum {
+    STATE_HEADER,
+    STATE_BODY,
+};
+
+struct client {
+    int sock;
+    int state;
+    int outstanding;
+    long body_left;
+    struct timespec sent;
+    int rlen;
+    char rbuf[RBUF_SZ];
+};
+
+static struct sockaddr_in addr;
+static char *request;
+static int request_len;
+static int depth = 1;
+static bool churn;
+static int epoll_fd;
+
+static unsigned *latency;
+static unsigned long responses, errors;
+static unsigned long long bytes;
+
+static long elapsed_us(struct timespec *a, struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) * 1000000L + (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+static void send_request(struct client *c)
+{
+    clock_gettime(CLOCK_MONOTONIC, &c->sent);
+    if (send(c->sock, request, request_len, 0) != request_len) {
+        perror("send");
+        exit(1);
+    }
+    c->outstanding = depth;
+}
+
+static void connect_client(struct client *c)
+{
+    c->sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->sock < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+    if (connect(c->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+
+    c->state = STATE_HEADER;
+    c->rlen = 0;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->sock, &(struct epoll_event){.events = EPOLLIN, .data.ptr = c});
+    send_request(c);
+}
+
+static void reconnect_client(struct client *c)
+{
+    close(c->sock);
+    connect_client(c);
+}
+
+static void complete_response(struct client *c)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long us = elapsed_us(&c->sent, &now);
+    latency[us < LAT_BUCKETS ? us : LAT_BUCKETS - 1]++;
+    responses++;
+
+    c->state = STATE_HEADER;
+    if (--c->outstanding > 0)
+        return;
+    if (churn)
+        reconnect_client(c);
+    else
+        send_request(c);
+}
+
+/* Returns -1 if the response is malformed */
+static int parse_header(struct client *c, int header_len)
+{
+    if (c->rlen < 12 || memcmp(c->rbuf, "HTTP/1.1 2", 10) != 0)
+        return -1;
+
+    c->body_left = 0;
+    for (char *p = c->rbuf; p < c->rbuf + header_len; p++) {
+        if (*p == '\n' && strncasecmp(p + 1, "Content-Length:", 15) == 0) {
+            c->body_left = atol(p + 16);
+            break;
+        }
+    }
+    return 0;
+}
+
+static int consume(struct client *c)
+{
+    while (c->rlen > 0) {
+        if (c->state == STATE_HEADER) {
+            char *end = memmem(c->rbuf, c->rlen, "\r\n\r\n", 4);
+            if (!end)
+                return c->rlen == RBUF_SZ ? -1 : 0;
+
+            int header_len = end + 4 - c->rbuf;
+            if (parse_header(c, header_len) < 0)
+                return -1;
+
+            bytes += header_len;
+            c->rlen -= header_len;
+            memmove(c->rbuf, c->rbuf + header_len, c->rlen);
+            c->state = STATE_BODY;
+        }
+
+        long take = c->body_left < c->rlen ? c->body_left : c->rlen;
+        c->body_left -= take;
+        c->rlen -= take;
+        bytes += take;
+        memmove(c->rbuf, c->rbuf + take, c->rlen);
+
+        if (c->body_left > 0)
+            return 0;
+        complete_response(c);
+    }
+
+    /* A response with an empty body completes without further reads */
+    if (c->state == STATE_BODY && c->body_left == 0)
+        complete_response(c);
+    return 0;
+}
+
+static long percentile(double p)
+{
+    unsigned long target = responses * p, seen = 0;
+    for (long i = 0; i < LAT_BUCKETS; i++) {
+        seen += latency[i];
+        if (seen > target)
+            return i;
+    }
+    return LAT_BUCKETS - 1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-a addr] [-c conns] [-d seconds] [-p path] [-D depth] [-C] [port]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int conns = 16, duration = 5, port = DEFAULT_SERVER_PORT;
+    const char *path = "/", *host = "127.0.0.1";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:c:d:p:D:C")) != -1) {
+        switch (opt) {
+        case 'a':
+            host = optarg;
+            break;
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'p':
+            path = optarg;
+            break;
+        case 'D':
+            depth = atoi(optarg);
+            if (depth < 1 || depth > MAX_DEPTH)
+                usage(argv[0]);
+            break;
+        case 'C':
+            churn = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind < argc)
+        port = atoi(argv[optind]);
+    if (churn && depth > 1)
+        usage(argv[0]);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+        usage(argv[0]);
+
+    char one[1024];
+    int one_len = snprintf(one, sizeof(one), "GET %s HTTP/1.1\r\nHost: localhost\r\n%s\r\n", path,
+                       churn ? "Connection: close\r\n" : "");
+
+    request_len = one_len * depth;
+    request = malloc(request_len);
+    for (int i = 0; i < depth; i++)
+        memcpy(request + i * one_len, one, one_len);
+
+    latency = calloc(LAT_BUCKETS, sizeof(*latency));
+    struct client *clients = calloc(conns, sizeof(*clients));
+    epoll_fd = epoll_create1(0);
+
+    for (int i = 0; i < conns; i++)
+        connect_client(&clients[i]);
+
+    struct timespec start, now;
+    struct epoll_event ev[MAX_EVENTS];
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    do {
+        int n = epoll_wait(epoll_fd, ev, MAX_EVENTS, 100);
+        for (int i = 0; i < n; i++) {
+            struct client *c = ev[i].data.ptr;
+            ssize_t ret = recv(c->sock, c->rbuf + c->rlen, RBUF_SZ - c->rlen, 0);
+            if (ret <= 0) {
+                errors++;
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->sock, NULL);
+                reconnect_client(c);
+                continue;
+            }
+
+            c->rlen += ret;
+            if (consume(c) < 0) {
+                errors++;
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->sock, NULL);
+                reconnect_client(c);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (elapsed_us(&start, &now) < duration * 1000000L);
+
+    double secs = elapsed_us(&start, &now) / 1e6;
+    printf("requests:       %lu\n", responses);
+    printf("errors:         %lu\n", errors);
+    printf("requests/s:     %.0f\n", responses / secs);
+    printf("transfer/s:     %.2f MB\n", bytes / secs / (1 << 20));
+    printf("latency p50:    %ld us\n", percentile(0.50));
+    printf("latency p99:    %ld us\n", percentile(0.99));
+    printf("latency p99.9:  %ld us\n", percentile(0.999));
+
+    for (int i = 0; i < conns; i++)
+        close(clients[i].sock);
+    return 0;
+}
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+/*
+ * Open a number of keep-alive connections to a server, send one request on
+ * each so that the server has fully set the connection up, and then leave
+ * them idle. The server's resident set size is sampled before and after to
+ * report the memory held per idle connection.
+ */
+
+#define DEFAULT_SERVER_PORT     8000
+#define BUF_SZ                  4096
+
+static const char *request = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+static long read_rss_kb(int pid)
+{
+    char path[64], line[256];
+    long rss = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror("fopen");
+        exit(1);
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "VmRSS:", 6) == 0) {
+            rss = atol(line + 6);
+            break;
+        }
+    }
+
+    fclose(f);
+    return rss;
+}
+
+static int open_conn(struct sockaddr_in *addr)
+{
+    char buf[BUF_SZ];
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    if (connect(sock, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+
+    if (send(sock, request, strlen(request), 0) < 0 || recv(sock, buf, sizeof(buf), 0) <= 0) {
+        fprintf(stderr, "request failed\n");
+        exit(1);
+    }
+
+    return sock;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s -P server_pid [-c conns] [-w seconds] [port]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int conns = 10000, wait = 0, pid = 0, port = DEFAULT_SERVER_PORT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "P:c:w:")) != -1) {
+        switch (opt) {
+        case 'P':
+            pid = atoi(optarg);
+            break;
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 'w':
+            wait = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (!pid)
+        usage(argv[0]);
+    if (optind < argc)
+        port = atoi(argv[optind]);
+
+    struct rlimit rlim;
+    getrlimit(RLIMIT_NOFILE, &rlim);
+    rlim.rlim_cur = rlim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rlim);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int *socks = calloc(conns, sizeof(*socks));
+
+    long before = read_rss_kb(pid);
+    for (int i = 0; i < conns; i++)
+        socks[i] = open_conn(&addr);
+    /* Let the server finish handling the last responses */
+    sleep(1);
+    long after = read_rss_kb(pid);
+
+    printf("connections:          %d\n", conns);
+    printf("rss before:           %ld kB\n", before);
+    printf("rss after:            %ld kB\n", after);
+    printf("rss per idle conn:    %.0f bytes\n", (after - before) * 1024.0 / conns);
+
+    sleep(wait);
+
+    for (int i = 0; i < conns; i++)
+        close(socks[i]);
+    free(socks);
+    return 0;
+}
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Request latency of the io_uring server with and without NAPI busy polling.
+# Runs http_load against the server once per configuration and prints the
+# latency percentiles.
+#
+# usage: ./napi_latency.sh [addr] [seconds] [connections] [busy poll usecs]
+#
+# Loopback has no NAPI, so run the client across a device that has one. A
+# veth pair into a network namespace works when GRO is on for the server
+# side, which makes veth receive through NAPI:
+#
+#   ip netns add napi-client
+#   ip link add napi0 type veth peer name napi1 netns napi-client
+#   ip addr add 10.77.0.1/24 dev napi0 && ip link set napi0 up
+#   ethtool -K napi0 gro on
+#   ip netns exec napi-client ip addr add 10.77.0.2/24 dev napi1
+#   ip netns exec napi-client ip link set napi1 up
+#   NETNS=napi-client ./napi_latency.sh 10.77.0.1
+
+ADDR=${1:-127.0.0.1}
+DURATION=${2:-5}
+CONNS=${3:-1}
+BUSY_POLL=${4:-50}
+PORT=8290
+SERVER=../io-uring/server
+CLIENT=./http_load
+[ -n "$NETNS" ] && CLIENT="ip netns exec $NETNS $CLIENT"
+
+# usage: run port [server options]
+run() {
+    port=$1
+    shift
+    $SERVER "$@" $port > /dev/null &
+    pid=$!
+    sleep 0.5
+    $CLIENT -a $ADDR -c $CONNS -d $DURATION $port |
+        awk '/requests\/s/ { rps = $2 } /p50/ { p50 = $3 } /p99:/ { p99 = $3 } /p99.9/ { p999 = $3 }
+             END { printf "%10s %10s %10s %10s\n", rps, p50, p99, p999 }'
+    kill $pid
+    wait $pid 2> /dev/null
+}
+
+printf "%-24s %10s %10s %10s %10s\n" "mode" "req/s" "p50 us" "p99 us" "p99.9 us"
+# A killed io_uring server releases its port only once the ring is torn
+# down, so every run gets a fresh port
+printf "%-24s %s\n" "interrupts" "$(run $PORT)"
+printf "%-24s %s\n" "napi $BUSY_POLL us" "$(run $((PORT + 1)) -N $BUSY_POLL)"
+printf "%-24s %s\n" "napi $BUSY_POLL us, prefer" "$(run $((PORT + 2)) -N $BUSY_POLL -B)"
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Throughput of each server as the number of pipelined requests per
+# connection grows. Runs every server once per depth and prints the
+# requests/s reported by http_load.
+#
+# usage: ./pipeline.sh [seconds] [connections]
+
+DURATION=${1:-5}
+CONNS=${2:-16}
+PORT=8190
+
+# usage: run port depth server [server options]
+run() {
+    port=$1
+    depth=$2
+    shift 2
+    "$@" $port > /dev/null &
+    pid=$!
+    sleep 0.5
+    ./http_load -c $CONNS -d $DURATION -D $depth $port | awk '/requests\/s/ { print $2 }'
+    kill $pid
+    wait $pid 2> /dev/null
+}
+
+printf "%6s %14s %14s %14s %14s\n" "depth" "io-uring" "io-uring -b" "multi-process" "epoll"
+for depth in 1 4 16 64; do
+    # A killed io_uring server releases its port only once the ring is torn
+    # down, so every run gets a fresh port
+    PORT=$((PORT + 4))
+    uring=$(run $PORT $depth ../io-uring/server)
+    bufring=$(run $((PORT + 1)) $depth ../io-uring/server -b)
+    mp=$(run $((PORT + 2)) $depth ../multi-process/server)
+    ep=$(run $((PORT + 3)) $depth ../epoll/server)
+    printf "%6d %14s %14s %14s %14s\n" $depth "$uring" "$bufring" "$mp" "$ep"
+done
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Find the response size above which IORING_OP_SEND_ZC beats a copying send.
+# Runs the io_uring server once per size with and without -z and compares
+# the throughput reported by http_load.
+#
+# usage: ./zc_crossover.sh [seconds] [connections]
+
+DURATION=${1:-5}
+CONNS=${2:-16}
+PORT=8090
+SERVER=../io-uring/server
+
+# usage: run port [server options]
+run() {
+    port=$1
+    shift
+    $SERVER "$@" $port > /dev/null &
+    pid=$!
+    sleep 0.5
+    ./http_load -c $CONNS -d $DURATION $port | awk '/transfer/ { print $2 }'
+    kill $pid
+    wait $pid 2> /dev/null
+}
+
+printf "%10s %14s %14s\n" "size" "send MB/s" "send_zc MB/s"
+for size in 1024 4096 16384 32768 65536 131072 262144 524288 1048576; do
+    # A killed io_uring server releases its port only once the ring is torn
+    # down, so every run gets a fresh port
+    PORT=$((PORT + 2))
+    copy=$(run $PORT -R $size)
+    zc=$(run $((PORT + 1)) -R $size -z 1)
+    printf "%10d %14s %14s\n" $size "$copy" "$zc"
+done
@@ -1,16 +1,24 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <signal.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/utsname.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include "picohttpparser.h"
+#include "timerwheel.h"
 
 #define SERVER_STRING           "Server: zerohttpd/0.1\r\n"
 #define DEFAULT_SERVER_PORT     8000
@@ -25,6 +33,73 @@
 #define MIN_MAJOR_VERSION       5
 
 #define MAX_SQE_PER_LOOP        5
+#define MAX_BATCH               16
+
+/* Connections taken off the listener per readiness event */
+#define MAX_ACCEPTS_PER_EVENT   64
+/* How long the listener stays paused after running out of fds, in ms */
+#define ACCEPT_BACKOFF_MS       100
+
+/* Connection timeouts, in seconds */
+#define DEFAULT_IDLE_TIMEOUT    60
+#define DEFAULT_HEADER_TIMEOUT  20
+#define DEFAULT_WRITE_TIMEOUT   30
+
+enum {
+    TIMER_NONE,
+    TIMER_IDLE,
+    TIMER_HEADER,
+    TIMER_WRITE,
+};
+
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+struct server_config {
+    int port;
+    int threads;
+    bool shared_listener;
+    int idle_timeout;
+    int header_timeout;
+    int write_timeout;
+    int max_conns;
+};
+
+static struct server_config config = {
+    .port = DEFAULT_SERVER_PORT,
+    .threads = 1,
+    .idle_timeout = DEFAULT_IDLE_TIMEOUT,
+    .header_timeout = DEFAULT_HEADER_TIMEOUT,
+    .write_timeout = DEFAULT_WRITE_TIMEOUT,
+};
+
+/*
+ * Each worker owns an epoll instance and every connection it accepts, and
+ * either its own SO_REUSEPORT listener or a share of a single one. Every
+ * connection deadline lives in the worker's timer wheel, which counts in
+ * milliseconds and sets the epoll_wait timeout.
+ */
+struct worker {
+    int id;
+    int cpu;
+    int sock;
+    int epoll_fd;
+    pthread_t thread;
+    int nr_conns;
+    /* Whether the listener is in the epoll set, and when to put it back */
+    bool listening;
+    struct tw_timer accept_timer;
+    /* Time of the last epoll_wait return, in ms */
+    uint64_t now;
+    struct timer_wheel timers;
+};
+
+static struct worker *workers;
+
+/*
+ * Held open so that, out of fds, a worker can free one to accept and close
+ * a waiting client instead of leaving the listener readable forever.
+ */
+static int reserve_fd = -1;
 
 static const char* response =
             "HTTP/1.1 200 OK\r\n"
@@ -43,9 +118,26 @@ static const char* bad_request =
             "\r\n"
             "<!DOCTYPE html><head><title>Bad Request!</title></head><body><h1>Bad Request!</h1></body></html>";
 
-static bool should_close_connection(struct phr_header *headers, size_t num_headers)
+static const char* continue_response = "HTTP/1.1 100 Continue\r\n\r\n";
+
+enum {
+    BODY_NONE,
+    BODY_LENGTH,
+    BODY_CHUNKED,
+};
+
+static bool should_close_connection(const struct phr_header *headers, size_t num_headers,
+                                    const struct phr_header_index *index)
 {
-    for (size_t i = 0; i < num_headers; i++) {
+    const struct phr_header *hdr = phr_find_header(headers, index, PHR_HEADER_CONNECTION);
+
+    if (!hdr)
+        return false;
+    if (!(index->repeated & (1u << PHR_HEADER_CONNECTION)))
+        return hdr->value_len == 5 && strncasecmp(hdr->value, "close", 5) == 0;
+
+    /* Repeated Connection headers are rare enough to scan for */
+    for (size_t i = hdr - headers; i < num_headers; i++) {
         if (headers[i].name_len == 10 && strncasecmp(headers[i].name, "connection", 10) == 0) {
             if (headers[i].value_len == 5 && strncasecmp(headers[i].value, "close", 5) == 0)
                 return true;
@@ -54,149 +146,650 @@ static bool should_close_connection(struct phr_header *headers, size_t num_heade
     return false;
 }
 
+static bool expects_continue(const struct phr_header *headers, size_t num_headers)
+{
+    for (size_t i = 0; i < num_headers; i++) {
+        if (headers[i].name_len == 6 && strncasecmp(headers[i].name, "expect", 6) == 0)
+            return headers[i].value_len == 12 && strncasecmp(headers[i].value, "100-continue", 12) == 0;
+    }
+    return false;
+}
+
+/*
+ * Work out how the request body is framed. Conflicting or repeated framing
+ * headers, a transfer coding other than chunked and a malformed length are
+ * refused, as something in front of the server might frame the body
+ * differently. Returns BODY_NONE, BODY_LENGTH with *length set, BODY_CHUNKED
+ * or -1.
+ */
+static int body_framing(const struct phr_header *headers, const struct phr_header_index *index,
+                        unsigned long long *length)
+{
+    const struct phr_header *te = phr_find_header(headers, index, PHR_HEADER_TRANSFER_ENCODING);
+    const struct phr_header *cl = phr_find_header(headers, index, PHR_HEADER_CONTENT_LENGTH);
+
+    if (index->repeated & ((1u << PHR_HEADER_TRANSFER_ENCODING) | (1u << PHR_HEADER_CONTENT_LENGTH)))
+        return -1;
+    if (te && cl)
+        return -1;
+    if (te)
+        return te->value_len == 7 && strncasecmp(te->value, "chunked", 7) == 0 ? BODY_CHUNKED : -1;
+    if (!cl)
+        return BODY_NONE;
+
+    /* 18 digits cannot overflow */
+    if (cl->value_len == 0 || cl->value_len > 18)
+        return -1;
+    *length = 0;
+    for (size_t i = 0; i < cl->value_len; i++) {
+        if (!isdigit((unsigned char)cl->value[i]))
+            return -1;
+        *length = *length * 10 + (cl->value[i] - '0');
+    }
+    return *length ? BODY_LENGTH : BODY_NONE;
+}
+
+/*
+ * Connections are registered edge-triggered, so every event must be drained:
+ * reads continue until the socket runs dry and all complete requests in the
+ * buffer are answered. Responses to pipelined requests are queued in iov and
+ * sent optimistically with one writev as soon as the batch is parsed; EPOLLOUT
+ * is only subscribed to while the queue is stuck behind a full socket buffer,
+ * so the common case needs no epoll_ctl at all.
+ */
+struct conn;
+
+/*
+ * Endpoint that consumes a request body. start is called while the request
+ * headers are still valid, data with every window of decoded body in the
+ * receive buffer, and end once the body is complete. Each may queue
+ * responses that point into the window.
+ */
+struct body_handler {
+    void (*start)(struct conn *conn, const struct phr_header *headers, size_t num_headers);
+    void (*data)(struct conn *conn, const char *data, size_t len);
+    void (*end)(struct conn *conn);
+};
+
 struct conn {
-    int epoll_fd;
+    struct worker *worker;
     int sock;
     bool shutdown;
+    bool want_out;
     /* recv buf */
     int buflen, prevbuflen;
     char reqbuf[BUF_SZ];
-    /* send buf */
-    int sendbuf_sz;
-    const char *sendbuf;
+    /* queued responses, iov[iov_off] onwards is still to be sent */
+    int iov_off, nr_iov;
+    struct iovec iov[MAX_BATCH];
+    /*
+     * Request body being streamed to its handler. The first window bytes of
+     * reqbuf were last handed to it and stay put until the queue is sent,
+     * as responses may point into them.
+     */
+    const struct body_handler *body;
+    int body_kind;
+    bool close_after_body;
+    unsigned long long body_left;
+    struct phr_chunked_decoder decoder;
+    int window;
+    char echo_head[192];
+    char chunk_size[24];
+    /* which deadline the timer is counting down */
+    int timer_kind;
+    struct tw_timer timer;
 };
 
-static void shutdown_conn(struct conn *conn)
+static uint64_t now_ms(void)
 {
-    conn->shutdown = true;
-    epoll_ctl(conn->epoll_fd, EPOLL_CTL_MOD, conn->sock, &(struct epoll_event){.events = EPOLLOUT, .data.ptr = conn});    
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static uint32_t listen_events(void)
+{
+    return EPOLLIN | (config.shared_listener ? EPOLLEXCLUSIVE : 0);
+}
+
+/* Stop accepting, until a connection closes or after delay_ms if non-zero */
+static void pause_listener(struct worker *w, int delay_ms)
+{
+    if (w->listening) {
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, w->sock, NULL);
+        w->listening = false;
+    }
+    if (delay_ms)
+        tw_add(&w->timers, &w->accept_timer, w->now + delay_ms);
+}
+
+static void resume_listener(struct worker *w)
+{
+    if (w->listening)
+        return;
+
+    tw_del(&w->timers, &w->accept_timer);
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->sock, &(struct epoll_event){.events = listen_events(), .data.fd = w->sock});
+    w->listening = true;
+}
+
+static void resume_accepting(struct tw_timer *timer)
+{
+    resume_listener(container_of(timer, struct worker, accept_timer));
 }
 
 static void close_conn(struct conn *conn)
 {
+    struct worker *w = conn->worker;
+
+    tw_del(&w->timers, &conn->timer);
     close(conn->sock);
     free(conn);
+
+    w->nr_conns--;
+    if (!w->listening && (!config.max_conns || w->nr_conns < config.max_conns))
+        resume_listener(w);
+}
+
+static void set_conn_timer(struct conn *conn, int kind)
+{
+    struct worker *w = conn->worker;
+    int timeout = kind == TIMER_IDLE ? config.idle_timeout :
+                  kind == TIMER_HEADER ? config.header_timeout : config.write_timeout;
+
+    conn->timer_kind = kind;
+    if (timeout)
+        tw_add(&w->timers, &conn->timer, w->now + timeout * 1000ULL);
+    else
+        tw_del(&w->timers, &conn->timer);
+}
+
+/*
+ * A connection with nothing buffered is idle on keep-alive. Once part of a
+ * request has arrived, the header timeout runs from its first bytes and is
+ * not extended by further reads, so trickling clients still expire. While
+ * responses are stuck behind a full socket the write timeout runs instead,
+ * renewed whenever the client takes some of them.
+ */
+static void update_conn_timer(struct conn *conn)
+{
+    int kind = conn->nr_iov > 0 ? TIMER_WRITE : conn->buflen > 0 ? TIMER_HEADER : TIMER_IDLE;
+
+    if (kind != conn->timer_kind)
+        set_conn_timer(conn, kind);
 }
 
-static void send_response(struct conn *conn, const char *response)
+static void expire_conn(struct tw_timer *timer)
 {
-    conn->sendbuf = response;
-    conn->sendbuf_sz = strlen(response);
-    conn->prevbuflen = 0;
-    epoll_ctl(conn->epoll_fd, EPOLL_CTL_MOD, conn->sock, &(struct epoll_event){.events = EPOLLOUT, .data.ptr = conn});
+    close_conn(container_of(timer, struct conn, timer));
 }
 
-static void send_bad_request(struct conn *conn)
+static int watch_writable(struct conn *conn, bool want_out)
 {
-    send_response(conn, bad_request);
-    shutdown_conn(conn);
+    if (conn->want_out == want_out)
+        return 0;
+
+    uint32_t events = EPOLLIN | EPOLLET | (want_out ? EPOLLOUT : 0);
+    if (epoll_ctl(conn->worker->epoll_fd, EPOLL_CTL_MOD, conn->sock, &(struct epoll_event){.events = events, .data.ptr = conn}) < 0)
+        return -1;
+    conn->want_out = want_out;
+    return 0;
 }
 
-static void accept_connetion(int epoll_fd, int sock)
+static void queue_data(struct conn *conn, const char *buf, size_t len)
 {
-    int fd = accept(sock, NULL, NULL);
-    if (fd < 0) {
-        perror("accept");
+    conn->iov[conn->nr_iov++] = (struct iovec){ .iov_base = (void *)buf, .iov_len = len };
+}
+
+static void queue_response(struct conn *conn, const char *buf)
+{
+    queue_data(conn, buf, strlen(buf));
+}
+
+static void queue_bad_request(struct conn *conn)
+{
+    conn->shutdown = true;
+    queue_response(conn, bad_request);
+}
+
+/* Drop what a short writev got out of the queue */
+static void advance_iov(struct conn *conn, size_t sent)
+{
+    while (conn->iov_off < conn->nr_iov && sent >= conn->iov[conn->iov_off].iov_len)
+        sent -= conn->iov[conn->iov_off++].iov_len;
+
+    if (conn->iov_off < conn->nr_iov) {
+        struct iovec *iov = &conn->iov[conn->iov_off];
+        iov->iov_base = (char *)iov->iov_base + sent;
+        iov->iov_len -= sent;
     }
+}
 
-    struct conn *conn = calloc(1, sizeof(*conn));
-    conn->epoll_fd = epoll_fd;
-    conn->sock = fd;
-    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &(struct epoll_event){.events = EPOLLIN, .data.ptr = conn});
+/* Returns -1 on a socket error; leaves nr_iov non-zero if the socket is full */
+static int flush_responses(struct conn *conn)
+{
+    while (conn->iov_off < conn->nr_iov) {
+        ssize_t ret = writev(conn->sock, conn->iov + conn->iov_off, conn->nr_iov - conn->iov_off);
+        if (ret < 0) {
+            if (errno == EAGAIN)
+                return watch_writable(conn, true);
+            return -1;
+        }
+        advance_iov(conn, ret);
+        if (conn->timer_kind == TIMER_WRITE)
+            set_conn_timer(conn, TIMER_WRITE);
+    }
+
+    conn->iov_off = conn->nr_iov = 0;
+    return watch_writable(conn, false);
 }
 
-static void attempt_recv(struct conn *conn)
+/*
+ * Out of fds: spend the reserve one on a waiting client, closing it at once
+ * so it gets a reset rather than hanging in the backlog. Workers that find
+ * the reserve already taken just back off.
+ */
+static void shed_connection(struct worker *w)
 {
-    int ret = recv(conn->sock, conn->reqbuf + conn->buflen, BUF_SZ - conn->buflen, 0);
-    if (ret <= 0) {
-        close_conn(conn);
+    int fd = __atomic_exchange_n(&reserve_fd, -1, __ATOMIC_ACQ_REL);
+    if (fd < 0)
         return;
+
+    close(fd);
+    fd = accept(w->sock, NULL, NULL);
+    if (fd >= 0)
+        close(fd);
+    __atomic_store_n(&reserve_fd, open("/dev/null", O_RDONLY | O_CLOEXEC), __ATOMIC_RELEASE);
+}
+
+static void accept_connections(struct worker *w)
+{
+    for (int i = 0; i < MAX_ACCEPTS_PER_EVENT && w->listening; i++) {
+        if (config.max_conns && w->nr_conns >= config.max_conns) {
+            pause_listener(w, 0);
+            return;
+        }
+
+        int fd = accept4(w->sock, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0) {
+            switch (errno) {
+            case EAGAIN:
+                /* Drained, or another worker sharing the listener took it */
+                return;
+            case ECONNABORTED:
+            case EINTR:
+            case EPROTO:
+                continue;
+            case EMFILE:
+            case ENFILE:
+                shed_connection(w);
+                pause_listener(w, ACCEPT_BACKOFF_MS);
+                return;
+            case ENOBUFS:
+            case ENOMEM:
+                pause_listener(w, ACCEPT_BACKOFF_MS);
+                return;
+            default:
+                perror("accept");
+                return;
+            }
+        }
+
+        struct conn *conn = calloc(1, sizeof(*conn));
+        if (!conn) {
+            close(fd);
+            pause_listener(w, ACCEPT_BACKOFF_MS);
+            return;
+        }
+
+        conn->worker = w;
+        conn->sock = fd;
+        tw_timer_init(&conn->timer, expire_conn);
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &(struct epoll_event){.events = EPOLLIN | EPOLLET, .data.ptr = conn}) < 0) {
+            close(fd);
+            free(conn);
+            continue;
+        }
+        w->nr_conns++;
+        update_conn_timer(conn);
     }
+}
 
-    conn->prevbuflen = conn->buflen;
-    conn->buflen += ret;
-    int pret, minor_version;
-    const char *method, *path;
-    struct phr_header headers[50];
-    size_t method_len, path_len, num_headers = 50;
-    pret = phr_parse_request(conn->reqbuf, conn->buflen, &method, &method_len, &path, &path_len,
-                             &minor_version, headers, &num_headers, conn->prevbuflen);
+/*
+ * POST /echo: send the body straight back, framed the way it came in, one
+ * chunk per window when it came chunked. The data is sent from the window.
+ */
+static void echo_start(struct conn *conn, const struct phr_header *headers, size_t num_headers)
+{
+    char *head = conn->echo_head;
+    size_t size = sizeof(conn->echo_head);
+    int len = 0;
+
+    if (expects_continue(headers, num_headers))
+        len = snprintf(head, size, "%s", continue_response);
+    len += snprintf(head + len, size - len,
+                    "HTTP/1.1 200 OK\r\n"
+                    "Server: Assdi2024Server/1.0\r\n"
+                    "Content-Type: application/octet-stream\r\n");
+    if (conn->body_kind == BODY_CHUNKED)
+        len += snprintf(head + len, size - len, "Transfer-Encoding: chunked\r\n\r\n");
+    else
+        len += snprintf(head + len, size - len, "Content-Length: %llu\r\n\r\n", conn->body_left);
+    queue_data(conn, head, len);
+}
 
-    if (pret == -2) {
-        if (conn->buflen == BUF_SZ)
-            send_bad_request(conn);
-        return;
-    } else if (pret == -1) {
-        send_bad_request(conn);
-        return;
+static void echo_data(struct conn *conn, const char *data, size_t len)
+{
+    if (conn->body_kind == BODY_CHUNKED)
+        queue_data(conn, conn->chunk_size, snprintf(conn->chunk_size, sizeof(conn->chunk_size), "%zx\r\n", len));
+    queue_data(conn, data, len);
+    if (conn->body_kind == BODY_CHUNKED)
+        queue_data(conn, "\r\n", 2);
+}
+
+static void echo_end(struct conn *conn)
+{
+    if (conn->body_kind == BODY_CHUNKED)
+        queue_data(conn, "0\r\n\r\n", 5);
+}
+
+static const struct body_handler echo_handler = { echo_start, echo_data, echo_end };
+
+/* Queue entries a body handler may need in the round its body starts */
+#define BODY_IOVS               5
+
+static const struct body_handler *find_body_handler(const char *method, size_t method_len,
+                                                    const char *path, size_t path_len)
+{
+    if (method_len == 4 && memcmp(method, "POST", 4) == 0 && path_len == 5 && memcmp(path, "/echo", 5) == 0)
+        return &echo_handler;
+    return NULL;
+}
+
+static void end_body(struct conn *conn)
+{
+    conn->body->end(conn);
+    conn->body = NULL;
+    conn->shutdown = conn->close_after_body;
+}
+
+/*
+ * Hand everything buffered of the body to the handler as the next window.
+ * Chunked framing is decoded in place, which leaves the window at the start
+ * of reqbuf followed by whatever came after the body.
+ */
+static void feed_body(struct conn *conn)
+{
+    size_t n = conn->buflen;
+    bool done;
+
+    if (conn->body_kind == BODY_LENGTH) {
+        if (n > conn->body_left)
+            n = conn->body_left;
+        conn->body_left -= n;
+        done = conn->body_left == 0;
+    } else {
+        ssize_t rest = phr_decode_chunked(&conn->decoder, conn->reqbuf, &n);
+        if (rest == -1) {
+            /* Too late for an error response */
+            conn->shutdown = true;
+            return;
+        }
+        conn->buflen = n + (rest > 0 ? rest : 0);
+        done = rest >= 0;
     }
 
-    if (method_len != 3 || memcmp(method, "GET", 3) != 0) {
-        send_bad_request(conn);
-        return;
+    conn->window = n;
+    if (n > 0)
+        conn->body->data(conn, conn->reqbuf, n);
+    if (done)
+        end_body(conn);
+}
+
+/*
+ * Queue a response for each complete request in the buffer, up to a batch.
+ * Returns true if it stopped with more to do once the queue is sent.
+ */
+static bool parse_requests(struct conn *conn)
+{
+    if (conn->window > 0) {
+        memmove(conn->reqbuf, conn->reqbuf + conn->window, conn->buflen - conn->window);
+        conn->buflen -= conn->window;
+        conn->window = 0;
     }
 
-    conn->shutdown = conn->shutdown || minor_version != 1 || should_close_connection(headers, num_headers);
+    while (!conn->shutdown && conn->buflen > 0) {
+        if (conn->body) {
+            feed_body(conn);
+            if (conn->window > 0)
+                return true;
+            continue;
+        }
+        if (conn->nr_iov == MAX_BATCH)
+            return true;
+
+        int pret, minor_version;
+        const char *method, *path;
+        struct phr_header headers[50];
+        struct phr_header_index index;
+        size_t method_len, path_len, num_headers = 50;
+        pret = phr_parse_request_indexed(conn->reqbuf, conn->buflen, &method, &method_len, &path, &path_len,
+                                         &minor_version, headers, &num_headers, conn->prevbuflen, &index);
+
+        if (pret == -2) {
+            if (conn->buflen == BUF_SZ)
+                queue_bad_request(conn);
+            conn->prevbuflen = conn->buflen;
+            return false;
+        } else if (pret == -1) {
+            queue_bad_request(conn);
+            return false;
+        }
 
-    memmove(conn->reqbuf, conn->reqbuf + pret, conn->buflen - pret);
-    conn->buflen -= pret;
-    conn->prevbuflen = 0;
+        const struct body_handler *handler = find_body_handler(method, method_len, path, path_len);
+        unsigned long long length = 0;
+        int kind = body_framing(headers, &index, &length);
+
+        if ((!handler && (method_len != 3 || memcmp(method, "GET", 3) != 0)) ||
+            kind < 0 || (kind != BODY_NONE && !handler)) {
+            queue_bad_request(conn);
+            return false;
+        }
 
-    send_response(conn, response);
+        /* Parsed again once the queue has room for what the handler sends */
+        if (handler && conn->nr_iov > MAX_BATCH - BODY_IOVS)
+            return true;
+
+        bool close = minor_version != 1 || should_close_connection(headers, num_headers, &index);
+
+        if (handler) {
+            conn->body = handler;
+            conn->body_kind = kind == BODY_NONE ? BODY_LENGTH : kind;
+            conn->body_left = length;
+            conn->close_after_body = close;
+            memset(&conn->decoder, 0, sizeof(conn->decoder));
+            conn->decoder.consume_trailer = 1;
+            handler->start(conn, headers, num_headers);
+            if (kind == BODY_NONE)
+                end_body(conn);
+        } else {
+            conn->shutdown = close;
+            queue_response(conn, response);
+        }
+
+        memmove(conn->reqbuf, conn->reqbuf + pret, conn->buflen - pret);
+        conn->buflen -= pret;
+        conn->prevbuflen = 0;
+    }
+    return false;
 }
 
-static void attempt_send(struct conn *conn)
+/*
+ * Answer every complete request in the buffer a batch at a time, stopping
+ * early if the socket cannot take the whole batch or the connection is
+ * closing.
+ */
+static int serve_requests(struct conn *conn)
 {
-    if (conn->sendbuf_sz == 0)
-        goto end;
-    int ret = send(conn->sock, conn->sendbuf, conn->sendbuf_sz, 0);
-    if (ret <= 0) {
-        close_conn(conn);
+    while (!conn->shutdown && conn->nr_iov == 0) {
+        bool more = parse_requests(conn);
+        if (conn->nr_iov == 0 && !more)
+            return 0;
+        /* The next request, or the keep-alive wait for it, gets a fresh deadline */
+        conn->timer_kind = TIMER_NONE;
+
+        if (flush_responses(conn) < 0)
+            return -1;
+        if (!more)
+            break;
     }
-end:
-    if (conn->shutdown) {
-        close_conn(conn);
-    } else {
-        epoll_ctl(conn->epoll_fd, EPOLL_CTL_MOD, conn->sock,
-                &(struct epoll_event){.events = EPOLLIN, .data.ptr = conn});
+    return 0;
+}
+
+/*
+ * Reading pauses while a response is pending so a client that does not read
+ * cannot make the server buffer without bound; attempt_send resumes it.
+ * Otherwise it goes on until EAGAIN, even after a short read: a FIN that
+ * came in with the request raises no further edge.
+ */
+static int attempt_recv(struct conn *conn)
+{
+    while (!conn->shutdown && conn->nr_iov == 0) {
+        int room = BUF_SZ - conn->buflen;
+        ssize_t ret = recv(conn->sock, conn->reqbuf + conn->buflen, room, 0);
+        if (ret < 0)
+            return errno == EAGAIN ? 0 : -1;
+        if (ret == 0)
+            return -1;
+
+        conn->buflen += ret;
+        if (serve_requests(conn) < 0)
+            return -1;
     }
+    return 0;
+}
+
+static int attempt_send(struct conn *conn)
+{
+    if (flush_responses(conn) < 0)
+        return -1;
+    if (conn->nr_iov > 0)
+        return 0;
+    if (serve_requests(conn) < 0)
+        return -1;
+    return attempt_recv(conn);
+}
+
+static void handle_conn_event(struct conn *conn, uint32_t events)
+{
+    int ret;
+
+    /* Errors are picked up by whichever call touches the socket first */
+    if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+        ret = attempt_send(conn);
+    else
+        ret = attempt_recv(conn);
+
+    if (ret < 0 || (conn->shutdown && conn->nr_iov == 0))
+        close_conn(conn);
+    else
+        update_conn_timer(conn);
 }
 
-void server_loop(int sock)
+/*
+ * A shared listener is added with EPOLLEXCLUSIVE, so a new connection wakes
+ * one of the waiting workers rather than all of them.
+ */
+void server_loop(struct worker *w)
 {
-    int epoll_fd = epoll_create1(0);
+    int sock = w->sock;
     struct epoll_event ev[QUEUE_DEPTH];
 
-    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &(struct epoll_event){.events = EPOLLIN, .data.fd = sock});
+    w->epoll_fd = epoll_create1(0);
+    w->now = now_ms();
+    tw_init(&w->timers, w->now);
+    tw_timer_init(&w->accept_timer, resume_accepting);
+    resume_listener(w);
 
     while (1) {
-        int ret = epoll_wait(epoll_fd, ev, QUEUE_DEPTH, -1);
+        int ret = epoll_wait(w->epoll_fd, ev, QUEUE_DEPTH, tw_next_timeout(&w->timers));
         if (ret < 0) {
             perror("epoll_wait");
             exit(1);
         }
+
+        w->now = now_ms();
         for (int i = 0; i < ret; i++) {
             int fd = ev[i].data.fd;
             if (fd == sock) {
-                accept_connetion(epoll_fd, sock);
-            } else if (ev[i].events & EPOLLIN) {
-                attempt_recv((struct conn *)ev[i].data.ptr);
-            } else if (ev[i].events & EPOLLOUT) {
-                attempt_send((struct conn *)ev[i].data.ptr);
+                accept_connections(w);
+            } else {
+                handle_conn_event(ev[i].data.ptr, ev[i].events);
             }
         }
+
+        /* Only after the events, which may point at connections that are due */
+        tw_advance(&w->timers, w->now);
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *w = arg;
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(w->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+        fprintf(stderr, "worker %d: failed to pin to cpu %d\n", w->id, w->cpu);
+
+    server_loop(w);
+    return NULL;
+}
+
+/* Start one pinned worker per thread, spreading them over the allowed CPUs */
+static void start_workers(void)
+{
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE], ncpus = 0;
+
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed))
+            cpus[ncpus++] = cpu;
+    }
+
+    for (int i = 0; i < config.threads; i++) {
+        struct worker *w = &workers[i];
+        w->cpu = cpus[i % ncpus];
+
+        if (pthread_create(&w->thread, NULL, worker_thread, w) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
     }
+
+    for (int i = 0; i < config.threads; i++)
+        pthread_join(workers[i].thread, NULL);
 }
 
-static int setup_listening_socket(int port)
+static int setup_listening_socket(int port, bool reuseport)
 {
-    int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    int listen_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (listen_sock < 0) {
         perror("socket");
         exit(1);
     }
 
     setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+    if (reuseport)
+        setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int));
+
+    /*
+     * Accepted sockets inherit this. Without it a batch that follows one
+     * still in flight is held back by Nagle until the client's delayed ACK.
+     */
+    setsockopt(listen_sock, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
 
     struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
@@ -216,16 +809,87 @@ static int setup_listening_socket(int port)
     return listen_sock;
 }
 
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-t threads] [-x] [-c conns] [-k secs] [-H secs] [-W secs] [port]\n"
+                    "  -t  number of pinned worker threads, each with its own epoll\n"
+                    "      instance and SO_REUSEPORT listener (default 1)\n"
+                    "  -x  share one listener between the workers with EPOLLEXCLUSIVE\n"
+                    "  -c  stop accepting while a worker has this many connections,\n"
+                    "      0 for no limit (default)\n"
+                    "  -k  close keep-alive connections idle for this many seconds,\n"
+                    "      0 disables (default %d)\n"
+                    "  -H  close connections that take longer than this many seconds\n"
+                    "      to send a request, 0 disables (default %d)\n"
+                    "  -W  close connections that take no response data for this many\n"
+                    "      seconds while one is pending, 0 disables (default %d)\n", prog,
+            DEFAULT_IDLE_TIMEOUT, DEFAULT_HEADER_TIMEOUT, DEFAULT_WRITE_TIMEOUT);
+    exit(1);
+}
+
 int main(int argc, char *argv[])
 {
-    int port = DEFAULT_SERVER_PORT;
-    if (argc > 1)
-        port = atoi(argv[1]);
+    int opt;
+    while ((opt = getopt(argc, argv, "t:xc:k:H:W:")) != -1) {
+        switch (opt) {
+        case 't':
+            config.threads = atoi(optarg);
+            if (config.threads < 1)
+                usage(argv[0]);
+            break;
+        case 'x':
+            config.shared_listener = true;
+            break;
+        case 'c':
+            config.max_conns = atoi(optarg);
+            break;
+        case 'k':
+            config.idle_timeout = atoi(optarg);
+            break;
+        case 'H':
+            config.header_timeout = atoi(optarg);
+            break;
+        case 'W':
+            config.write_timeout = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind < argc)
+        config.port = atoi(argv[optind]);
+
+    /* A peer resetting mid-writev must fail the call, not kill the server */
+    signal(SIGPIPE, SIG_IGN);
 
-    int sock = setup_listening_socket(port);
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
-    printf("Listening on port %d\n", port);
-    server_loop(sock);
+    workers = calloc(config.threads, sizeof(*workers));
+    for (int i = 0; i < config.threads; i++) {
+        workers[i].id = i;
+        if (config.shared_listener && i > 0)
+            workers[i].sock = workers[0].sock;
+        else
+            workers[i].sock = setup_listening_socket(config.port, config.threads > 1 && !config.shared_listener);
+    }
+
+    printf("Listening on port %d\n", config.port);
+    if (config.threads > 1) {
+        printf("Using %d worker threads with %s\n", config.threads,
+               config.shared_listener ? "a shared EPOLLEXCLUSIVE listener" : "SO_REUSEPORT listeners");
+    }
+    if (config.max_conns)
+        printf("Connection limit: %d per worker\n", config.max_conns);
+    printf("Timeouts: idle %d s, header %d s, write %d s\n",
+           config.idle_timeout, config.header_timeout, config.write_timeout);
+    fflush(stdout);
+
+    if (config.threads > 1) {
+        start_workers();
+    } else {
+        server_loop(&workers[0]);
+    }
     fprintf(stderr, "server exiting\n");
     return 0;
 }
@@ -0,0 +1,133 @@
+#include <string.h>
+#include "timerwheel.h"
+
+/* The pending bitmaps are one uint64_t per level */
+_Static_assert(TW_SLOTS == 64, "pending bitmap must have a bit per slot");
+
+#define LEVEL_SHIFT(level)      (TW_BITS * (level))
+
+void tw_init(struct timer_wheel *w, uint64_t now)
+{
+    memset(w, 0, sizeof(*w));
+    w->now = now;
+}
+
+/*
+ * A timer goes in the lowest level whose span covers its distance from now,
+ * in the slot its expiry falls into. That slot is at most one rotation ahead
+ * of the level's current one, so it is reached before the timer is due.
+ */
+static void link_timer(struct timer_wheel *w, struct tw_timer *timer)
+{
+    uint64_t delta = timer->expires - w->now;
+    int level = 0;
+
+    if (delta > TW_MAX_TIMEOUT) {
+        delta = TW_MAX_TIMEOUT;
+        timer->expires = w->now + delta;
+    }
+    while (level < TW_LEVELS - 1 && delta >= 1ULL << LEVEL_SHIFT(level + 1))
+        level++;
+
+    int slot = (timer->expires >> LEVEL_SHIFT(level)) & (TW_SLOTS - 1);
+    struct tw_timer **head = &w->slots[level][slot];
+
+    timer->next = *head;
+    if (timer->next)
+        timer->next->pprev = &timer->next;
+    *head = timer;
+    timer->pprev = head;
+    w->pending[level] |= 1ULL << slot;
+}
+
+void tw_del(struct timer_wheel *w, struct tw_timer *timer)
+{
+    struct tw_timer **pprev = timer->pprev;
+
+    if (!pprev)
+        return;
+
+    *pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+
+    /* Removing the last timer in a slot leaves its head pointer NULL */
+    struct tw_timer **first = &w->slots[0][0];
+    if (!*pprev && pprev >= first && pprev < first + TW_LEVELS * TW_SLOTS) {
+        long idx = pprev - first;
+        w->pending[idx / TW_SLOTS] &= ~(1ULL << (idx % TW_SLOTS));
+    }
+}
+
+void tw_add(struct timer_wheel *w, struct tw_timer *timer, uint64_t expires)
+{
+    tw_del(w, timer);
+    /* The current tick has already run */
+    timer->expires = expires > w->now ? expires : w->now + 1;
+    link_timer(w, timer);
+}
+
+/* Move every timer in the level's current slot down towards level 0 */
+static void cascade(struct timer_wheel *w, int level)
+{
+    int slot = (w->now >> LEVEL_SHIFT(level)) & (TW_SLOTS - 1);
+    struct tw_timer *timer = w->slots[level][slot];
+
+    w->slots[level][slot] = NULL;
+    w->pending[level] &= ~(1ULL << slot);
+
+    while (timer) {
+        struct tw_timer *next = timer->next;
+        link_timer(w, timer);
+        timer = next;
+    }
+}
+
+void tw_advance(struct timer_wheel *w, uint64_t now)
+{
+    while (w->now < now) {
+        /* Skip straight over ticks where no slot needs attention */
+        int64_t next = tw_next_timeout(w);
+        if (next < 0 || w->now + next > now) {
+            w->now = now;
+            break;
+        }
+        w->now += next;
+
+        for (int level = TW_LEVELS - 1; level > 0; level--) {
+            if ((w->now & ((1ULL << LEVEL_SHIFT(level)) - 1)) == 0)
+                cascade(w, level);
+        }
+
+        struct tw_timer **head = &w->slots[0][w->now & (TW_SLOTS - 1)];
+        while (*head) {
+            struct tw_timer *timer = *head;
+            tw_del(w, timer);
+            timer->fn(timer);
+        }
+    }
+}
+
+int64_t tw_next_timeout(const struct timer_wheel *w)
+{
+    int64_t best = -1;
+
+    for (int level = 0; level < TW_LEVELS; level++) {
+        uint64_t pending = w->pending[level];
+        if (!pending)
+            continue;
+
+        /* Rotate so that bit 0 is the slot after the current one */
+        uint64_t base = w->now >> LEVEL_SHIFT(level);
+        int from = (base + 1) & (TW_SLOTS - 1);
+        uint64_t rotated = from ? (pending >> from) | (pending << (TW_SLOTS - from)) : pending;
+        uint64_t ahead = __builtin_ctzll(rotated) + 1;
+
+        int64_t delta = ((base + ahead) << LEVEL_SHIFT(level)) - w->now;
+        if (best < 0 || delta < best)
+            best = delta;
+    }
+    return best;
+}
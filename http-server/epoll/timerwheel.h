@@ -0,0 +1,76 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel. Time is counted in ticks of whatever unit the
+ * caller advances it by. Each level has TW_SLOTS slots, each covering
+ * TW_SLOTS times the span of a slot one level down. Adding, re-arming and
+ * cancelling a timer take constant time. Advancing jumps straight to the
+ * next slot that holds timers, and a timer moves down at most once per level
+ * it started above.
+ */
+
+#define TW_BITS         6
+#define TW_SLOTS        (1 << TW_BITS)
+#define TW_LEVELS       4
+/* Timers further out than this are clamped to it */
+#define TW_MAX_TIMEOUT  ((1ULL << (TW_BITS * TW_LEVELS)) - 1)
+
+struct tw_timer;
+
+typedef void (*tw_expire_fn)(struct tw_timer *timer);
+
+struct tw_timer {
+    struct tw_timer *next, **pprev;
+    uint64_t expires;
+    tw_expire_fn fn;
+};
+
+struct timer_wheel {
+    uint64_t now;
+    /* Bit n of pending[level] is set while slots[level][n] is non-empty */
+    uint64_t pending[TW_LEVELS];
+    struct tw_timer *slots[TW_LEVELS][TW_SLOTS];
+};
+
+static inline void tw_timer_init(struct tw_timer *timer, tw_expire_fn fn)
+{
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->fn = fn;
+}
+
+static inline bool tw_timer_pending(const struct tw_timer *timer)
+{
+    return timer->pprev != NULL;
+}
+
+void tw_init(struct timer_wheel *w, uint64_t now);
+
+/*
+ * Arm the timer to fire at the given tick, re-arming it if it is already
+ * pending. A tick that has already passed fires on the next advance.
+ */
+void tw_add(struct timer_wheel *w, struct tw_timer *timer, uint64_t expires);
+
+void tw_del(struct timer_wheel *w, struct tw_timer *timer);
+
+/*
+ * Run the wheel up to now and call the function of every timer that
+ * expired. The timer is no longer pending when it runs, so the function may
+ * free it or re-arm it for a later tick.
+ */
+void tw_advance(struct timer_wheel *w, uint64_t now);
+
+/*
+ * Ticks until the wheel next has work to do, or -1 if no timer is pending.
+ * For a timer in an upper level this is when it moves down a level, which
+ * is never later than its expiry.
+ */
+int64_t tw_next_timeout(const struct timer_wheel *w);
+
+#endif
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
@@ -9,6 +10,12 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/utsname.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/resource.h>
+#include <linux/openat2.h>
 #include "picohttpparser.h"
 
 #define SERVER_STRING           "Server: zerohttpd/0.1\r\n"
@@ -16,15 +23,188 @@
 #define QUEUE_DEPTH             256
 #define BUF_SZ                  8192
 
-#define EVENT_TYPE_ACCEPT       0
-#define EVENT_TYPE_READ         1
-#define EVENT_TYPE_WRITE        2
+/*
+ * Completions carry the event type in the low bits of user_data and the
+ * connection, if any, in the remaining bits; connections come from malloc
+ * and are at least 16-byte aligned.
+ */
+#define EVENT_TYPE_NONE         0
+#define EVENT_TYPE_ACCEPT       1
+#define EVENT_TYPE_READ         2
+#define EVENT_TYPE_WRITE        3
+#define EVENT_TYPE_TICK         4
+#define EVENT_TYPE_OPEN         5
+#define EVENT_TYPE_STATX        6
+#define EVENT_TYPE_SPLICE_IN    7
+#define EVENT_TYPE_SPLICE_OUT   8
+#define EVENT_TYPE_MASK         15
 
 #define MIN_KERNEL_VERSION      5
 #define MIN_MAJOR_VERSION       5
 
-#define MAX_SQE_PER_LOOP        5
-#define MAX_REQUEST                2048
+/* Smallest SQ -q accepts; a linked chain must fit in it */
+#define MIN_SQ_ENTRIES          8
+
+/* Pipelined requests answered by a single send */
+#define MAX_BATCH               16
+
+/* Free connections and partial request buffers each worker keeps for reuse */
+#define MAX_CACHED              2048
+
+/* Shared provided-buffer ring used by multishot recv */
+#define BUF_RING_GROUP          0
+#define BUF_RING_ENTRIES        1024
+#define BUF_RING_BUF_SZ         4096
+
+/*
+ * Provided buffers a connection may hold on to while a body backs up, and
+ * all connections of a worker together, so the rest of the ring keeps
+ * serving everyone else
+ */
+#define BODY_MAX_HELD           16
+#define WORKER_MAX_HELD         (BUF_RING_ENTRIES / 2)
+
+/* Queue entries a body handler needs for a window and the end of the body */
+#define BODY_IOVS               4
+
+/* io_uring_register_napi appeared in liburing 2.6 */
+#if IO_URING_VERSION_MAJOR > 2 || (IO_URING_VERSION_MAJOR == 2 && IO_URING_VERSION_MINOR >= 6)
+#define HAVE_IO_URING_NAPI
+#endif
+
+/* Upper bound of the sparse registered file table, also capped by RLIMIT_NOFILE */
+#define MAX_FIXED_FILES         65536
+
+/* Static files: longest path served, and pipes each worker keeps for reuse */
+#define MAX_FILE_PATH           256
+#define MAX_CACHED_PIPES        64
+#define PIPE_SZ                 (1 << 20)
+
+/*
+ * Seconds a keep-alive connection may sit idle, a started request may take,
+ * and a send may go without progress
+ */
+#define DEFAULT_IDLE_TIMEOUT    60
+#define DEFAULT_HEADER_TIMEOUT  20
+#define DEFAULT_SEND_TIMEOUT    60
+
+struct server_config {
+    int port;
+    int threads;
+    int sq_entries;
+    int cq_entries;
+    bool multishot_accept;
+    bool buf_ring;
+    bool fixed_files;
+    bool sqpoll;
+    bool sq_thread_shared;
+    int sq_thread_cpu;
+    int sq_thread_idle;
+    bool low_overhead;
+    int napi_busy_poll_to;
+    bool napi_prefer_busy_poll;
+    int zc_threshold;
+    int response_size;
+    const char *docroot;
+    int idle_timeout;
+    int header_timeout;
+    int send_timeout;
+    bool stats;
+};
+
+static struct server_config config = {
+    .port = DEFAULT_SERVER_PORT,
+    .threads = 1,
+    .sq_entries = QUEUE_DEPTH,
+    .sq_thread_cpu = -1,
+    .idle_timeout = DEFAULT_IDLE_TIMEOUT,
+    .header_timeout = DEFAULT_HEADER_TIMEOUT,
+    .send_timeout = DEFAULT_SEND_TIMEOUT,
+};
+
+struct server_stats {
+    unsigned long accepts;
+    unsigned long idle_timeouts;
+    unsigned long header_timeouts;
+    unsigned long send_timeouts;
+    unsigned long sq_full;
+    unsigned long cq_backlog;
+    struct timespec last_report;
+};
+
+struct conn;
+
+/*
+ * Endpoint that consumes a request body. start is called while the request
+ * headers are still valid, data with every window of decoded body, and end
+ * once the body is complete. Each may queue responses that point into the
+ * window.
+ */
+struct body_handler {
+    void (*start)(struct conn *conn, const struct phr_header *headers, size_t num_headers);
+    void (*data)(struct conn *conn, const char *data, size_t len);
+    void (*end)(struct conn *conn);
+};
+
+struct splice_pipe {
+    int fd[2];
+    int size;
+};
+
+/*
+ * Connections waiting on the same timeout, in deadline order: a connection
+ * is always appended with now + timeout, so the head expires first.
+ */
+struct conn_list {
+    struct conn *head, *tail;
+};
+
+/* A LIFO of free objects, linked through their first bytes */
+struct cache {
+    void *head;
+    int len;
+};
+
+/*
+ * Each worker owns a ring, a listening socket and all of its pools; workers
+ * share nothing but the read-only configuration.
+ */
+struct worker {
+    int id;
+    int cpu;
+    int sock;
+    pthread_t thread;
+    struct io_uring ring;
+    bool multishot_accept;
+    struct io_uring_buf_ring *buf_ring;
+    char *buf_ring_bufs;
+    /* Provided buffers held by connections, chained by buffer id */
+    int *held_next;
+    int *held_len;
+    int nr_held;
+    /* Connections whose recv found the ring empty, and buffers since returned */
+    struct conn_list parked_list;
+    int recycled;
+    struct cache conn_cache;
+    struct cache buf_cache;
+    struct cache file_cache;
+    struct splice_pipe pipes[MAX_CACHED_PIPES];
+    int nr_pipes;
+    time_t now;
+    struct conn_list idle_list;
+    struct conn_list header_list;
+    struct conn_list send_list;
+    struct server_stats stats;
+};
+
+static struct worker *workers;
+static sem_t worker_ready;
+
+/* Directory static files are served from, -1 for the hello page */
+static int docroot_fd = -1;
+
+/* Interval of the periodic statistics report and timeout sweep */
+static struct __kernel_timespec tick_ts = { .tv_sec = 1 };
 
 static const char* response =
             "HTTP/1.1 200 OK\r\n"
@@ -33,6 +213,7 @@ static const char* response =
             "Content-Length: 98\r\n"
             "\r\n"
             "<!DOCTYPE html><head><title>Hello, World!</title></head><body><h1>Hello, World!</h1></body></html>";
+static int response_len;
 
 static const char* bad_request =
             "HTTP/1.1 400 Bad Request\r\n"
@@ -43,9 +224,34 @@ static const char* bad_request =
             "\r\n"
             "<!DOCTYPE html><head><title>Bad Request!</title></head><body><h1>Bad Request!</h1></body></html>";
 
-static bool should_close_connection(struct phr_header *headers, size_t num_headers)
+static const char* not_found =
+            "HTTP/1.1 404 Not Found\r\n"
+            "Server: Assdi2024Server/1.0\r\n"
+            "Content-Type: text/html\r\n"
+            "Content-Length: 92\r\n"
+            "\r\n"
+            "<!DOCTYPE html><head><title>Not Found!</title></head><body><h1>Not Found!</h1></body></html>";
+
+static const char* continue_response = "HTTP/1.1 100 Continue\r\n\r\n";
+
+enum {
+    BODY_NONE,
+    BODY_LENGTH,
+    BODY_CHUNKED,
+};
+
+static bool should_close_connection(const struct phr_header *headers, size_t num_headers,
+                                    const struct phr_header_index *index)
 {
-    for (size_t i = 0; i < num_headers; i++) {
+    const struct phr_header *hdr = phr_find_header(headers, index, PHR_HEADER_CONNECTION);
+
+    if (!hdr)
+        return false;
+    if (!(index->repeated & (1u << PHR_HEADER_CONNECTION)))
+        return hdr->value_len == 5 && strncasecmp(hdr->value, "close", 5) == 0;
+
+    /* Repeated Connection headers are rare enough to scan for */
+    for (size_t i = hdr - headers; i < num_headers; i++) {
         if (headers[i].name_len == 10 && strncasecmp(headers[i].name, "connection", 10) == 0) {
             if (headers[i].value_len == 5 && strncasecmp(headers[i].value, "close", 5) == 0)
                 return true;
@@ -54,168 +260,1216 @@ static bool should_close_connection(struct phr_header *headers, size_t num_heade
     return false;
 }
 
+/*
+ * With the buffer ring, buf is only allocated while a partial request has to
+ * be kept across reads, so an idle connection holds no receive buffer.
+ * With fixed files, sock is a slot in the registered file table rather than
+ * a file descriptor. A connection waiting for the client sits on one of the
+ * worker's timeout lists. prevlen is how much of the partial request at the
+ * start of buf the parser has already seen without finding its end, so the
+ * next read only looks at what is new. Responses are gathered in iov and
+ * sent together; msg describes the part of the send still in flight. While a static file
+ * is being served, file holds its state and no further request is parsed.
+ *
+ * While a request body streams to its handler, body is set. Body data waits
+ * in buf and, with the buffer ring, in the provided buffers it arrived in,
+ * which are held in order from held_head; held_off is how much of the first
+ * one is gone. The first window bytes of buf or of the first held buffer
+ * were last handed to the handler and stay put until the send completes, as
+ * responses may point into them.
+ */
 struct conn {
-    struct io_uring *ring;
+    struct worker *worker;
     int sock;
     int buflen, prevlen;
     bool shutdown;
     bool reading, writing;
-    char buf[BUF_SZ];
-    int sendbuf_sz;
-    const char *sendbuf;
+    bool cancelling;
+    bool parked;
+    int zc_notifs;
+    char *buf;
+    int nr_iov;
+    struct iovec iov[MAX_BATCH];
+    struct msghdr msg;
+    struct file_send *file;
+    const struct body_handler *body;
+    int body_kind;
+    bool close_after_body;
+    unsigned long long body_left;
+    struct phr_chunked_decoder decoder;
+    int window;
+    bool window_held;
+    int held_head, held_tail, held_off, nr_held;
+    char echo_head[192];
+    char chunk_size[24];
+    struct conn_list *timer_list;
+    struct conn *timer_prev, *timer_next;
+    time_t deadline;
+    struct conn *park_prev, *park_next;
 };
 
-struct req {
-    struct conn *conn;
-    int type;
-    struct req *next;
+enum {
+    FILE_OPENING,       /* open, then statx of the opened file, in flight */
+    FILE_READY,         /* headers built, waiting for earlier responses */
+    FILE_HEADER,        /* headers being sent */
+    FILE_BODY,          /* splices in flight */
 };
 
-static struct req *req_head = NULL;
-static int num_reqs = 0;
+/*
+ * A static file response. Once the open completes, the headers are built
+ * from a statx of the opened fd, so they describe the inode that is sent
+ * rather than whatever the path names by then. The body then moves file ->
+ * pipe -> socket with linked pairs of splices, so it never passes through
+ * userspace. A short splice into the pipe breaks the link; whatever it
+ * moved is sent on the next round.
+ */
+struct file_send {
+    int state;
+    int pending;
+    bool aborted;
+    bool missing;
+    int fd;
+    int header_len;
+    off_t off, size;
+    int in_pipe;
+    struct splice_pipe pipe;
+    struct open_how how;
+    struct statx stx;
+    char path[MAX_FILE_PATH];
+    char header[512];
+};
 
-static struct req *get_request(void)
+static void *cache_get(struct cache *cache, size_t size)
 {
-    struct req *req = NULL;
+    void *item = cache->head;
 
-    if (req_head) {
-        req = req_head;
-        req_head = req->next;
-        num_reqs--;
+    if (!item)
+        return malloc(size);
+
+    cache->head = *(void **)item;
+    cache->len--;
+    return item;
+}
+
+static void cache_put(struct cache *cache, void *item)
+{
+    if (cache->len >= MAX_CACHED) {
+        free(item);
+        return;
+    }
+
+    *(void **)item = cache->head;
+    cache->head = item;
+    cache->len++;
+}
+
+static struct conn *alloc_conn(struct worker *w)
+{
+    struct conn *conn;
+
+    if (config.buf_ring) {
+        conn = cache_get(&w->conn_cache, sizeof(*conn));
+        memset(conn, 0, sizeof(*conn));
     } else {
-        req = calloc(1, sizeof(*req));
+        conn = cache_get(&w->conn_cache, sizeof(*conn) + BUF_SZ);
+        memset(conn, 0, sizeof(*conn));
+        conn->buf = (char *)(conn + 1);
     }
 
-    return req;
+    conn->worker = w;
+    return conn;
 }
 
-static void put_request(struct req *req)
+static void free_conn(struct conn *conn)
 {
-    req->next = req_head;
-    req_head = req;
-    num_reqs++;
+    if (config.buf_ring && conn->buf)
+        cache_put(&conn->worker->buf_cache, conn->buf);
+    cache_put(&conn->worker->conn_cache, conn);
+}
 
-    /* Free requests */
-    if (num_reqs > MAX_REQUEST * 2) {
-        for (int i = 0; i < num_reqs - MAX_REQUEST; i++) {
-            req = get_request();
-            free(req);
-        }
+static void set_user_data(struct io_uring_sqe *sqe, struct conn *conn, int type)
+{
+    io_uring_sqe_set_data64(sqe, (__u64)(uintptr_t)conn | type);
+}
+
+/*
+ * Make room for nr more SQEs by submitting what is queued. An SQPOLL ring
+ * frees entries only as its SQ thread consumes them, so wait for that too;
+ * io_uring_sqring_wait only sleeps while the SQ is completely full, and
+ * otherwise the SQ thread may need this CPU to make progress.
+ */
+static void reserve_sqes(struct worker *w, unsigned nr)
+{
+    if (io_uring_sq_space_left(&w->ring) >= nr)
+        return;
+
+    w->stats.sq_full++;
+    io_uring_submit(&w->ring);
+    while (io_uring_sq_space_left(&w->ring) < nr) {
+        if (io_uring_sq_space_left(&w->ring) == 0)
+            io_uring_sqring_wait(&w->ring);
+        else
+            sched_yield();
     }
 }
 
-static void add_accept_request(struct io_uring *ring, int sock)
+/*
+ * Every SQE is taken here, so a handler never sees a full SQ however many
+ * it queues. The SQEs of a linked chain must go out in one submit, so
+ * whoever queues one reserves the whole chain first.
+ */
+static struct io_uring_sqe *get_sqe(struct worker *w)
+{
+    reserve_sqes(w, 1);
+    return io_uring_get_sqe(&w->ring);
+}
+
+static void timer_stop(struct conn *conn)
+{
+    struct conn_list *list = conn->timer_list;
+
+    if (!list)
+        return;
+
+    if (conn->timer_prev)
+        conn->timer_prev->timer_next = conn->timer_next;
+    else
+        list->head = conn->timer_next;
+    if (conn->timer_next)
+        conn->timer_next->timer_prev = conn->timer_prev;
+    else
+        list->tail = conn->timer_prev;
+
+    conn->timer_list = NULL;
+    conn->timer_prev = conn->timer_next = NULL;
+}
+
+static void timer_start(struct conn *conn, struct conn_list *list, int timeout)
 {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
-    struct req *request = get_request();
-    request->type = EVENT_TYPE_ACCEPT;
-    io_uring_prep_accept(sqe, sock, NULL, NULL, 0);
-    io_uring_sqe_set_data(sqe, request);
+    timer_stop(conn);
+    if (!timeout)
+        return;
+
+    /* now may lag by up to a tick, so round up rather than expire early */
+    conn->deadline = conn->worker->now + timeout + 1;
+    conn->timer_list = list;
+    conn->timer_prev = list->tail;
+    if (list->tail)
+        list->tail->timer_next = conn;
+    else
+        list->head = conn;
+    list->tail = conn;
 }
 
+/*
+ * A connection with nothing buffered is idle on keep-alive; once part of a
+ * request has arrived, the header timeout runs from its first bytes and is
+ * not extended by further reads, so trickling clients still expire. While
+ * a response is being sent, the send timeout runs instead and is restarted
+ * by every send that makes progress, so a client that stops reading cannot
+ * hold on to its buffers.
+ */
+static void update_conn_timer(struct conn *conn)
+{
+    struct worker *w = conn->worker;
+
+    if (conn->writing || conn->file) {
+        if (conn->timer_list != &w->send_list)
+            timer_start(conn, &w->send_list, config.send_timeout);
+    } else if (conn->shutdown)
+        timer_stop(conn);
+    else if (conn->buflen > 0 && conn->timer_list != &w->header_list)
+        timer_start(conn, &w->header_list, config.header_timeout);
+    else if (conn->buflen == 0 && conn->timer_list != &w->idle_list)
+        timer_start(conn, &w->idle_list, config.idle_timeout);
+}
+
+/*
+ * A multishot accept stays armed and posts one CQE per connection with
+ * IORING_CQE_F_MORE set; it only has to be re-added once the kernel drops it.
+ * With fixed files, accepted sockets go straight into a free slot of the
+ * registered file table picked by the kernel, and the CQE reports the slot.
+ */
+static void add_accept_request(struct worker *w)
+{
+    struct io_uring_sqe *sqe = get_sqe(w);
+    if (w->multishot_accept && config.fixed_files)
+        io_uring_prep_multishot_accept_direct(sqe, w->sock, NULL, NULL, 0);
+    else if (w->multishot_accept)
+        io_uring_prep_multishot_accept(sqe, w->sock, NULL, NULL, 0);
+    else if (config.fixed_files)
+        io_uring_prep_accept_direct(sqe, w->sock, NULL, NULL, 0, IORING_FILE_INDEX_ALLOC);
+    else
+        io_uring_prep_accept(sqe, w->sock, NULL, NULL, 0);
+    set_user_data(sqe, NULL, EVENT_TYPE_ACCEPT);
+}
+
+/* SQE flags for operations on a connection socket */
+static unsigned conn_sqe_flags(void)
+{
+    return config.fixed_files ? IOSQE_FIXED_FILE : 0;
+}
+
+static void add_tick_request(struct worker *w)
+{
+    struct io_uring_sqe *sqe = get_sqe(w);
+    io_uring_prep_timeout(sqe, &tick_ts, 0, 0);
+    set_user_data(sqe, NULL, EVENT_TYPE_TICK);
+}
+
+static void setup_buf_ring(struct worker *w)
+{
+    int ret;
+
+    w->buf_ring = io_uring_setup_buf_ring(&w->ring, BUF_RING_ENTRIES, BUF_RING_GROUP, 0, &ret);
+    if (!w->buf_ring) {
+        fprintf(stderr, "io_uring_setup_buf_ring: %s\n", strerror(-ret));
+        exit(1);
+    }
+
+    w->buf_ring_bufs = malloc(BUF_RING_ENTRIES * BUF_RING_BUF_SZ);
+    w->held_next = malloc(BUF_RING_ENTRIES * sizeof(*w->held_next));
+    w->held_len = malloc(BUF_RING_ENTRIES * sizeof(*w->held_len));
+    for (int i = 0; i < BUF_RING_ENTRIES; i++) {
+        io_uring_buf_ring_add(w->buf_ring, w->buf_ring_bufs + i * BUF_RING_BUF_SZ, BUF_RING_BUF_SZ, i,
+                              io_uring_buf_ring_mask(BUF_RING_ENTRIES), i);
+    }
+    io_uring_buf_ring_advance(w->buf_ring, BUF_RING_ENTRIES);
+}
+
+static void recycle_buffer(struct worker *w, int bid)
+{
+    io_uring_buf_ring_add(w->buf_ring, w->buf_ring_bufs + bid * BUF_RING_BUF_SZ, BUF_RING_BUF_SZ, bid,
+                          io_uring_buf_ring_mask(BUF_RING_ENTRIES), 0);
+    io_uring_buf_ring_advance(w->buf_ring, 1);
+    w->recycled++;
+}
+
+static void hold_buffer(struct conn *conn, int bid, int len)
+{
+    struct worker *w = conn->worker;
+
+    w->held_len[bid] = len;
+    w->nr_held++;
+    if (conn->nr_held++)
+        w->held_next[conn->held_tail] = bid;
+    else
+        conn->held_head = bid;
+    conn->held_tail = bid;
+}
+
+static void drop_held_buffer(struct conn *conn)
+{
+    int bid = conn->held_head;
+
+    conn->held_head = conn->worker->held_next[bid];
+    conn->held_off = 0;
+    conn->nr_held--;
+    conn->worker->nr_held--;
+    recycle_buffer(conn->worker, bid);
+}
+
+/*
+ * With the buffer ring, a multishot recv stays armed and picks a buffer from
+ * the ring for every completion; it only has to be re-added once the kernel
+ * drops it. A parked connection is re-added once buffers return.
+ */
 static void add_read_request(struct conn *conn)
 {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(conn->ring);
-    struct req *request = get_request();
-    request->type = EVENT_TYPE_READ;
-    request->conn = conn;
-    io_uring_prep_recv(sqe, conn->sock, conn->buf + conn->buflen, BUF_SZ - conn->buflen, 0);
-    io_uring_sqe_set_data(sqe, request);
+    if (conn->parked)
+        return;
+
+    struct io_uring_sqe *sqe = get_sqe(conn->worker);
+    if (config.buf_ring) {
+        io_uring_prep_recv_multishot(sqe, conn->sock, NULL, 0, 0);
+        io_uring_sqe_set_flags(sqe, conn_sqe_flags() | IOSQE_BUFFER_SELECT);
+        sqe->buf_group = BUF_RING_GROUP;
+    } else {
+        io_uring_prep_recv(sqe, conn->sock, conn->buf + conn->buflen, BUF_SZ - conn->buflen, 0);
+        io_uring_sqe_set_flags(sqe, conn_sqe_flags());
+    }
+    set_user_data(sqe, conn, EVENT_TYPE_READ);
     conn->reading = true;
 }
 
+/*
+ * A recv that found the buffer ring empty waits on the worker's parked list
+ * rather than being re-armed straight away, which would only fail again.
+ */
+static void park_read_request(struct conn *conn)
+{
+    struct conn_list *list = &conn->worker->parked_list;
+
+    conn->parked = true;
+    conn->park_prev = list->tail;
+    conn->park_next = NULL;
+    if (list->tail)
+        list->tail->park_next = conn;
+    else
+        list->head = conn;
+    list->tail = conn;
+}
+
+static void unpark_read_request(struct conn *conn)
+{
+    struct conn_list *list = &conn->worker->parked_list;
+
+    if (conn->park_prev)
+        conn->park_prev->park_next = conn->park_next;
+    else
+        list->head = conn->park_next;
+    if (conn->park_next)
+        conn->park_next->park_prev = conn->park_prev;
+    else
+        list->tail = conn->park_prev;
+    conn->parked = false;
+}
+
+/* Re-arm parked connections in order, one for every buffer returned */
+static void resume_parked_reads(struct worker *w)
+{
+    while (w->parked_list.head && w->recycled > 0) {
+        struct conn *conn = w->parked_list.head;
+
+        unpark_read_request(conn);
+        add_read_request(conn);
+        w->recycled--;
+    }
+    w->recycled = 0;
+}
+
+/* Cancel an armed multishot recv, which terminates with -ECANCELED */
+static void cancel_read_request(struct conn *conn)
+{
+    struct io_uring_sqe *sqe = get_sqe(conn->worker);
+    io_uring_prep_cancel_fd(sqe, conn->sock, config.fixed_files ? IORING_ASYNC_CANCEL_FD_FIXED : 0);
+    set_user_data(sqe, NULL, EVENT_TYPE_NONE);
+    conn->cancelling = true;
+}
+
+/*
+ * Stop the multishot recv while held body buffers back up. Cancelling by
+ * user_data rather than by fd leaves the sends on the socket alone.
+ */
+static void pause_read_request(struct conn *conn)
+{
+    struct io_uring_sqe *sqe = get_sqe(conn->worker);
+    io_uring_prep_cancel64(sqe, (__u64)(uintptr_t)conn | EVENT_TYPE_READ, 0);
+    set_user_data(sqe, NULL, EVENT_TYPE_NONE);
+    conn->cancelling = true;
+}
+
+/* Make a send or splice stuck on a client that does not read fail */
+static void shutdown_socket(struct conn *conn)
+{
+    struct io_uring_sqe *sqe = get_sqe(conn->worker);
+    io_uring_prep_shutdown(sqe, conn->sock, SHUT_RDWR);
+    io_uring_sqe_set_flags(sqe, conn_sqe_flags());
+    set_user_data(sqe, NULL, EVENT_TYPE_NONE);
+}
+
 static void close_connection(struct conn *conn)
 {
-    struct io_uring_sqe* sqe = io_uring_get_sqe(conn->ring);
-    io_uring_prep_close(sqe, conn->sock);
-    io_uring_sqe_set_data(sqe, NULL);
-    free(conn);
+    while (conn->nr_held)
+        drop_held_buffer(conn);
+    if (conn->parked)
+        unpark_read_request(conn);
+
+    struct io_uring_sqe* sqe = get_sqe(conn->worker);
+    /* Closing a fixed file frees its slot for the next direct accept */
+    if (config.fixed_files)
+        io_uring_prep_close_direct(sqe, conn->sock);
+    else
+        io_uring_prep_close(sqe, conn->sock);
+    set_user_data(sqe, NULL, EVENT_TYPE_NONE);
+    timer_stop(conn);
+    free_conn(conn);
 }
 
-static void add_write_request(struct conn *conn, const char *buf, int buflen)
+/*
+ * Sends of at least zc_threshold bytes use IORING_OP_SEND_ZC, which pins the
+ * buffer instead of copying it. The kernel posts a second, IORING_CQE_F_NOTIF
+ * completion once it no longer references the buffer; responses are never
+ * freed, so it only has to keep the connection alive until then. Echoed
+ * request bodies are, so they are always copied.
+ * A single buffer goes out with a plain send, several with one sendmsg.
+ */
+static void add_write_request(struct conn *conn)
 {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(conn->ring);
-    struct req *request = get_request();
-    request->type = EVENT_TYPE_WRITE;
-    request->conn = conn;
-    io_uring_prep_send(sqe, conn->sock, buf, buflen, 0);
-    io_uring_sqe_set_data(sqe, request);
+    struct io_uring_sqe *sqe = get_sqe(conn->worker);
+    struct iovec *iov = conn->msg.msg_iov;
+    size_t len = 0;
+
+    for (size_t i = 0; i < conn->msg.msg_iovlen; i++)
+        len += iov[i].iov_len;
+
+    /* File headers live in memory that is recycled with the transfer */
+    bool zc = config.zc_threshold && len >= (size_t)config.zc_threshold && !conn->file && !conn->window;
+    if (conn->msg.msg_iovlen == 1 && zc)
+        io_uring_prep_send_zc(sqe, conn->sock, iov->iov_base, len, 0, 0);
+    else if (conn->msg.msg_iovlen == 1)
+        io_uring_prep_send(sqe, conn->sock, iov->iov_base, len, 0);
+    else if (zc)
+        io_uring_prep_sendmsg_zc(sqe, conn->sock, &conn->msg, 0);
+    else
+        io_uring_prep_sendmsg(sqe, conn->sock, &conn->msg, 0);
+    io_uring_sqe_set_flags(sqe, conn_sqe_flags());
+    set_user_data(sqe, conn, EVENT_TYPE_WRITE);
     conn->writing = true;
 }
 
-static void handle_accept(struct io_uring *ring, struct io_uring_cqe* cqe)
+static void queue_response(struct conn *conn, const char *buf, int len)
+{
+    conn->iov[conn->nr_iov++] = (struct iovec){ .iov_base = (void *)buf, .iov_len = len };
+}
+
+/* Send every queued response at once; iov is left alone until it completes */
+static void flush_responses(struct conn *conn)
+{
+    if (!conn->nr_iov || conn->writing)
+        return;
+
+    conn->msg.msg_iov = conn->iov;
+    conn->msg.msg_iovlen = conn->nr_iov;
+    conn->nr_iov = 0;
+    add_write_request(conn);
+}
+
+/* Drop what a short send got out; returns whether anything is left */
+static bool advance_msg(struct msghdr *msg, size_t sent)
+{
+    while (msg->msg_iovlen > 0 && sent >= msg->msg_iov->iov_len) {
+        sent -= msg->msg_iov->iov_len;
+        msg->msg_iov++;
+        msg->msg_iovlen--;
+    }
+
+    if (msg->msg_iovlen > 0) {
+        msg->msg_iov->iov_base = (char *)msg->msg_iov->iov_base + sent;
+        msg->msg_iov->iov_len -= sent;
+    }
+    return msg->msg_iovlen > 0;
+}
+
+static void handle_accept(struct worker *w, struct io_uring_cqe* cqe)
 {   
-    if (cqe->res < 0)
+    if (cqe->res < 0) {
+        if (cqe->res == -EINVAL && w->multishot_accept) {
+            fprintf(stderr, "multishot accept is not supported, falling back to single-shot accept\n");
+            w->multishot_accept = false;
+        }
         return;
+    }
+
+    w->stats.accepts++;
 
-    struct conn *conn = calloc(1, sizeof(*conn));
+    struct conn *conn = alloc_conn(w);
     conn->sock = cqe->res;
-    conn->ring = ring;
     add_read_request(conn);
+    update_conn_timer(conn);
 }
 
 static void check_and_close_conn(struct conn *conn)
 {
-    if (!conn->reading && !conn->writing)
+    update_conn_timer(conn);
+
+    if (!conn->reading && !conn->writing && !conn->zc_notifs && !conn->file &&
+        (!conn->parked || conn->shutdown))
         close_connection(conn);
+    else if (conn->shutdown && conn->reading && !conn->writing && !conn->file &&
+             config.buf_ring && !conn->cancelling)
+        cancel_read_request(conn);
 }
 
 static void send_bad_request(struct conn *conn)
 {
-    add_write_request(conn, bad_request, strlen(bad_request));
+    queue_response(conn, bad_request, strlen(bad_request));
     conn->shutdown = true;
 }
 
-/* call at the end of read/write */
-static void handle_conn(struct conn *conn)
+static bool expects_continue(const struct phr_header *headers, size_t num_headers)
+{
+    for (size_t i = 0; i < num_headers; i++) {
+        if (headers[i].name_len == 6 && strncasecmp(headers[i].name, "expect", 6) == 0)
+            return headers[i].value_len == 12 && strncasecmp(headers[i].value, "100-continue", 12) == 0;
+    }
+    return false;
+}
+
+/*
+ * Work out how the request body is framed. Conflicting or repeated framing
+ * headers, a transfer coding other than chunked and a malformed length are
+ * refused, as something in front of the server might frame the body
+ * differently. Returns BODY_NONE, BODY_LENGTH with *length set, BODY_CHUNKED
+ * or -1.
+ */
+static int body_framing(const struct phr_header *headers, const struct phr_header_index *index,
+                        unsigned long long *length)
+{
+    const struct phr_header *te = phr_find_header(headers, index, PHR_HEADER_TRANSFER_ENCODING);
+    const struct phr_header *cl = phr_find_header(headers, index, PHR_HEADER_CONTENT_LENGTH);
+
+    if (index->repeated & ((1u << PHR_HEADER_TRANSFER_ENCODING) | (1u << PHR_HEADER_CONTENT_LENGTH)))
+        return -1;
+    if (te && cl)
+        return -1;
+    if (te)
+        return te->value_len == 7 && strncasecmp(te->value, "chunked", 7) == 0 ? BODY_CHUNKED : -1;
+    if (!cl)
+        return BODY_NONE;
+
+    /* 18 digits cannot overflow */
+    if (cl->value_len == 0 || cl->value_len > 18)
+        return -1;
+    *length = 0;
+    for (size_t i = 0; i < cl->value_len; i++) {
+        if (!isdigit((unsigned char)cl->value[i]))
+            return -1;
+        *length = *length * 10 + (cl->value[i] - '0');
+    }
+    return *length ? BODY_LENGTH : BODY_NONE;
+}
+
+static const char *content_type(const char *path)
+{
+    static const char *types[][2] = {
+        { ".html", "text/html" },
+        { ".htm",  "text/html" },
+        { ".css",  "text/css" },
+        { ".js",   "application/javascript" },
+        { ".json", "application/json" },
+        { ".txt",  "text/plain" },
+        { ".png",  "image/png" },
+        { ".jpg",  "image/jpeg" },
+        { ".gif",  "image/gif" },
+        { ".svg",  "image/svg+xml" },
+    };
+    const char *ext = strrchr(path, '.');
+
+    for (size_t i = 0; ext && i < sizeof(types) / sizeof(types[0]); i++) {
+        if (strcasecmp(ext, types[i][0]) == 0)
+            return types[i][1];
+    }
+    return "application/octet-stream";
+}
+
+/*
+ * Open the file a request path names under the document root. RESOLVE_BENEATH
+ * makes the kernel refuse anything that would escape it, including through
+ * ".." or symlinks. Returns false if the path is too long to serve.
+ */
+static bool start_file_request(struct conn *conn, const char *path, size_t path_len)
+{
+    const char *query = memchr(path, '?', path_len);
+    if (query)
+        path_len = query - path;
+    while (path_len > 0 && *path == '/') {
+        path++;
+        path_len--;
+    }
+
+    bool index = path_len == 0 || path[path_len - 1] == '/';
+    if (path_len + (index ? strlen("index.html") : 0) >= MAX_FILE_PATH)
+        return false;
+
+    struct worker *w = conn->worker;
+    struct file_send *file = cache_get(&w->file_cache, sizeof(*file));
+    memset(file, 0, sizeof(*file));
+    file->fd = -1;
+    file->pipe.fd[0] = file->pipe.fd[1] = -1;
+    memcpy(file->path, path, path_len);
+    if (index)
+        strcpy(file->path + path_len, "index.html");
+    file->how.flags = O_RDONLY | O_CLOEXEC;
+    file->how.resolve = RESOLVE_BENEATH;
+
+    struct io_uring_sqe *sqe = get_sqe(w);
+    io_uring_prep_openat2(sqe, docroot_fd, file->path, &file->how);
+    set_user_data(sqe, conn, EVENT_TYPE_OPEN);
+
+    file->state = FILE_OPENING;
+    file->pending = 1;
+    conn->file = file;
+    return true;
+}
+
+/*
+ * POST /echo: send the body straight back, framed the way it came in, one
+ * chunk per window when it came chunked. The data is sent from the window.
+ */
+static void echo_start(struct conn *conn, const struct phr_header *headers, size_t num_headers)
+{
+    char *head = conn->echo_head;
+    size_t size = sizeof(conn->echo_head);
+    int len = 0;
+
+    if (expects_continue(headers, num_headers))
+        len = snprintf(head, size, "%s", continue_response);
+    len += snprintf(head + len, size - len,
+                    "HTTP/1.1 200 OK\r\n"
+                    "Server: Assdi2024Server/1.0\r\n"
+                    "Content-Type: application/octet-stream\r\n");
+    if (conn->body_kind == BODY_CHUNKED)
+        len += snprintf(head + len, size - len, "Transfer-Encoding: chunked\r\n\r\n");
+    else
+        len += snprintf(head + len, size - len, "Content-Length: %llu\r\n\r\n", conn->body_left);
+    queue_response(conn, head, len);
+}
+
+static void echo_data(struct conn *conn, const char *data, size_t len)
+{
+    if (conn->body_kind == BODY_CHUNKED)
+        queue_response(conn, conn->chunk_size,
+                       snprintf(conn->chunk_size, sizeof(conn->chunk_size), "%zx\r\n", len));
+    queue_response(conn, data, len);
+    if (conn->body_kind == BODY_CHUNKED)
+        queue_response(conn, "\r\n", 2);
+}
+
+static void echo_end(struct conn *conn)
+{
+    if (conn->body_kind == BODY_CHUNKED)
+        queue_response(conn, "0\r\n\r\n", 5);
+}
+
+static const struct body_handler echo_handler = { echo_start, echo_data, echo_end };
+
+static const struct body_handler *find_body_handler(const char *method, size_t method_len,
+                                                    const char *path, size_t path_len)
+{
+    if (method_len == 4 && memcmp(method, "POST", 4) == 0 && path_len == 5 && memcmp(path, "/echo", 5) == 0)
+        return &echo_handler;
+    return NULL;
+}
+
+static void end_body(struct conn *conn)
+{
+    conn->body->end(conn);
+    conn->body = NULL;
+    conn->shutdown = conn->close_after_body;
+}
+
+static void release_window(struct conn *conn)
+{
+    if (conn->window_held) {
+        conn->held_off += conn->window;
+        if (conn->held_off == conn->worker->held_len[conn->held_head])
+            drop_held_buffer(conn);
+    } else if (conn->window > 0) {
+        memmove(conn->buf, conn->buf + conn->window, conn->buflen - conn->window);
+        conn->buflen -= conn->window;
+    }
+    conn->window = 0;
+    conn->window_held = false;
+}
+
+/*
+ * Hand the next piece of buffered body to the handler as a window: all of
+ * buf, or else what is left of the first held buffer. Chunked framing is
+ * decoded in place, which leaves the window at the start of the piece
+ * followed by whatever came after the body.
+ */
+static void feed_body(struct conn *conn)
+{
+    struct worker *w = conn->worker;
+    bool held = conn->buflen == 0;
+    char *data = held ? w->buf_ring_bufs + conn->held_head * BUF_RING_BUF_SZ + conn->held_off : conn->buf;
+    size_t len = held ? w->held_len[conn->held_head] - conn->held_off : conn->buflen;
+    size_t n = len, rest = 0;
+    bool done;
+
+    if (conn->body_kind == BODY_LENGTH) {
+        if (n > conn->body_left)
+            n = conn->body_left;
+        conn->body_left -= n;
+        rest = len - n;
+        done = conn->body_left == 0;
+    } else {
+        ssize_t ret = phr_decode_chunked(&conn->decoder, data, &n);
+        if (ret == -1) {
+            /* Too late for an error response */
+            conn->shutdown = true;
+            return;
+        }
+        rest = ret > 0 ? ret : 0;
+        done = ret >= 0;
+    }
+
+    if (held)
+        w->held_len[conn->held_head] = conn->held_off + n + rest;
+    else
+        conn->buflen = n + rest;
+    conn->window = n;
+    conn->window_held = held;
+
+    if (n > 0)
+        conn->body->data(conn, data, n);
+    if (done)
+        end_body(conn);
+    if (n == 0)
+        release_window(conn);
+}
+
+/* Outside a body, held data goes the usual way through buf as it fits */
+static void unhold_buffers(struct conn *conn)
+{
+    struct worker *w = conn->worker;
+
+    while (conn->nr_held && conn->buflen < BUF_SZ) {
+        int len = w->held_len[conn->held_head] - conn->held_off;
+        if (len > BUF_SZ - conn->buflen)
+            len = BUF_SZ - conn->buflen;
+        if (!conn->buf)
+            conn->buf = cache_get(&w->buf_cache, BUF_SZ);
+        memcpy(conn->buf + conn->buflen, w->buf_ring_bufs + conn->held_head * BUF_RING_BUF_SZ + conn->held_off, len);
+        conn->buflen += len;
+        conn->held_off += len;
+        if (conn->held_off == w->held_len[conn->held_head])
+            drop_held_buffer(conn);
+    }
+}
+
+/*
+ * Feed the buffered body to its handler until a window is queued or more
+ * of the body has to be read. Returns true once the body is over and the
+ * requests behind it can be parsed; otherwise the connection is left
+ * sending the window or waiting for the client.
+ */
+static bool serve_body(struct conn *conn)
+{
+    while (conn->body && !conn->shutdown && conn->nr_iov <= MAX_BATCH - BODY_IOVS &&
+           (conn->buflen > 0 || conn->nr_held > 0)) {
+        feed_body(conn);
+        if (conn->window > 0)
+            break;
+    }
+
+    if (!conn->body && !conn->window && !conn->shutdown) {
+        unhold_buffers(conn);
+        return true;
+    }
+
+    flush_responses(conn);
+    /* With the buffer ring, the recv stays paused until held buffers drain */
+    if (conn->body && !conn->shutdown && !conn->reading && !conn->nr_held && conn->buflen < BUF_SZ)
+        add_read_request(conn);
+    return false;
+}
+
+/*
+ * Parse one request out of data and queue its response. The first last_len
+ * bytes are known not to hold the end of the headers.
+ * Returns the number of bytes consumed, 0 if the request is incomplete,
+ * or -1 if a bad request response was queued.
+ */
+static int serve_request(struct conn *conn, const char *data, int len, int last_len)
 {
     const char *method, *path;
     size_t method_len, path_len, num_headers = 50;
     int minor_version;
     struct phr_header headers[50];
+    struct phr_header_index index;
     bool cont = true;
 
-    int pret = phr_parse_request(conn->buf, conn->buflen, &method, &method_len,
-                                 &path, &path_len, &minor_version, headers, &num_headers, 0);
+    int pret = phr_parse_request_indexed(data, len, &method, &method_len,
+                                         &path, &path_len, &minor_version, headers, &num_headers, last_len, &index);
 
-    if (pret == -2) {
-        if (conn->buflen == BUF_SZ) {
-            send_bad_request(conn);
-        } else if (!conn->reading) {
-            add_read_request(conn);
-        }
-        return;
+    if (pret == -2)
+        return 0;
+
+    const struct body_handler *handler = NULL;
+    unsigned long long length = 0;
+    int kind = -1;
+
+    if (pret > 0) {
+        handler = find_body_handler(method, method_len, path, path_len);
+        kind = body_framing(headers, &index, &length);
     }
 
     /* Error Handling */
-    if (pret < 0 || method_len != 3 || memcmp(method, "GET", 3) != 0) {
+    if (pret < 0 || (!handler && (method_len != 3 || memcmp(method, "GET", 3) != 0)) ||
+        kind < 0 || (kind != BODY_NONE && !handler)) {
         send_bad_request(conn);
-        return;
+        return -1;
     }
 
     cont = !conn->shutdown && minor_version == 1 &&
-            !should_close_connection(headers, num_headers);
+            !should_close_connection(headers, num_headers, &index);
 
-    /* Move remaining buffers */
-    memmove(conn->buf, conn->buf + pret, conn->buflen - pret);
-    conn->buflen -= pret;
+    /* The body is fed to the handler once the rest of the batch is queued */
+    if (handler) {
+        conn->body = handler;
+        conn->body_kind = kind == BODY_NONE ? BODY_LENGTH : kind;
+        conn->body_left = length;
+        conn->close_after_body = !cont;
+        memset(&conn->decoder, 0, sizeof(conn->decoder));
+        conn->decoder.consume_trailer = 1;
+        handler->start(conn, headers, num_headers);
+        if (kind == BODY_NONE)
+            end_body(conn);
+        return pret;
+    }
 
     /* Normal Response */
-    add_write_request(conn, response, strlen(response));
+    if (docroot_fd < 0)
+        queue_response(conn, response, response_len);
+    else if (!start_file_request(conn, path, path_len))
+        queue_response(conn, not_found, strlen(not_found));
 
     /* Check whether to close the connection */
     conn->shutdown = !cont;
 
-    if (cont && !conn->reading) {
+    return pret;
+}
+
+/*
+ * Queue responses for every complete request at the start of data, up to a
+ * batch or a request with a body. Returns the number of bytes consumed, or -1 if a bad request
+ * response was queued. If a partial request is left, prevlen is set to its
+ * length; data must then be conn->buf or about to be copied to its start.
+ */
+static int serve_requests(struct conn *conn, const char *data, int len)
+{
+    int consumed = 0, last_len = conn->prevlen;
+
+    conn->prevlen = 0;
+    while (!conn->shutdown && !conn->file && !conn->body && conn->nr_iov < MAX_BATCH) {
+        int pret = serve_request(conn, data + consumed, len - consumed, last_len);
+        if (pret < 0)
+            return -1;
+        if (pret == 0) {
+            conn->prevlen = len - consumed;
+            break;
+        }
+        consumed += pret;
+        last_len = 0;
+    }
+
+    return consumed;
+}
+
+/* call at the end of read/write */
+static void handle_conn(struct conn *conn)
+{
+    /* Requests behind a static file wait until it has been sent */
+    if (conn->file)
+        return;
+
+    release_window(conn);
+    if (!serve_body(conn))
+        return;
+
+    int pret = serve_requests(conn, conn->buf, conn->buflen);
+
+    /* Nothing parsed, but the end of a body may have been queued */
+    if (pret == 0) {
+        if (conn->buflen == BUF_SZ)
+            send_bad_request(conn);
+        flush_responses(conn);
+        if (!conn->shutdown && !conn->reading)
+            add_read_request(conn);
+        return;
+    }
+
+    if (pret < 0) {
+        flush_responses(conn);
+        return;
+    }
+
+    /* Move remaining buffers */
+    memmove(conn->buf, conn->buf + pret, conn->buflen - pret);
+    conn->buflen -= pret;
+
+    /* Drop the partial request storage once it is drained */
+    if (config.buf_ring && conn->buflen == 0) {
+        cache_put(&conn->worker->buf_cache, conn->buf);
+        conn->buf = NULL;
+    }
+
+    /*
+     * After a full batch, more requests may already be buffered; a plain recv
+     * would hold them back, so they are served once the send completes. The
+     * same goes for whatever follows a body that started in this batch, or
+     * a static file, which end_file_request picks up without a read.
+     */
+    bool full = conn->nr_iov == MAX_BATCH || conn->body || conn->file;
+    if (conn->body && !serve_body(conn))
+        return;
+    flush_responses(conn);
+
+    if (!conn->shutdown && !conn->reading && !full) {
         add_read_request(conn);
     }
 }
 
-static void handle_read(struct io_uring_cqe* cqe)
+/*
+ * Serve a request straight out of a provided buffer when nothing is pending
+ * on the connection, and copy into per-connection storage only what cannot
+ * be served yet. Body data is not copied: the buffer is held until its
+ * window has been sent, and so is anything that does not fit in buf behind
+ * responses still to be sent. Returns whether the buffer was held.
+ */
+static bool handle_buf_ring_data(struct conn *conn, int bid, int len)
+{
+    const char *data = conn->worker->buf_ring_bufs + bid * BUF_RING_BUF_SZ;
+
+    if (conn->shutdown)
+        return false;
+
+    if (conn->body || conn->nr_held ||
+        (len > BUF_SZ - conn->buflen && (conn->writing || conn->nr_iov || conn->file))) {
+        hold_buffer(conn, bid, len);
+        if ((conn->nr_held >= BODY_MAX_HELD || conn->worker->nr_held >= WORKER_MAX_HELD) &&
+            conn->reading && !conn->cancelling)
+            pause_read_request(conn);
+        if (!conn->writing)
+            handle_conn(conn);
+        return true;
+    }
+
+    if (conn->buflen == 0 && !conn->writing && !conn->file) {
+        int pret = serve_requests(conn, data, len);
+        if (pret < 0) {
+            flush_responses(conn);
+            return false;
+        }
+        data += pret;
+        len -= pret;
+    }
+
+    /* Nothing is pending, so buf holds a request too long to serve */
+    if (len > BUF_SZ - conn->buflen) {
+        send_bad_request(conn);
+        flush_responses(conn);
+        return false;
+    }
+
+    if (len > 0) {
+        if (!conn->buf)
+            conn->buf = cache_get(&conn->worker->buf_cache, BUF_SZ);
+        memcpy(conn->buf + conn->buflen, data, len);
+        conn->buflen += len;
+    }
+
+    /* Requests left over from a full batch are served once it is sent */
+    if (conn->nr_iov)
+        flush_responses(conn);
+    else if (len > 0 && !conn->writing)
+        handle_conn(conn);
+    return false;
+}
+
+static bool get_pipe(struct worker *w, struct splice_pipe *pipe)
 {
-    struct req *request = io_uring_cqe_get_data(cqe);
-    struct conn *conn = request->conn;
-    conn->reading = false;
+    if (w->nr_pipes > 0) {
+        *pipe = w->pipes[--w->nr_pipes];
+        return true;
+    }
+
+    if (pipe2(pipe->fd, O_CLOEXEC) < 0) {
+        perror("pipe2");
+        return false;
+    }
+
+    /* A bigger pipe moves more of the file per splice; the limit may refuse it */
+    fcntl(pipe->fd[1], F_SETPIPE_SZ, PIPE_SZ);
+    pipe->size = fcntl(pipe->fd[1], F_GETPIPE_SZ);
+    return true;
+}
+
+static void close_fd(struct worker *w, int fd)
+{
+    struct io_uring_sqe *sqe = get_sqe(w);
+    io_uring_prep_close(sqe, fd);
+    set_user_data(sqe, NULL, EVENT_TYPE_NONE);
+}
+
+/* Release the file and its pipe, then carry on with any pipelined requests */
+static void end_file_request(struct conn *conn)
+{
+    struct worker *w = conn->worker;
+    struct file_send *file = conn->file;
+
+    if (file->fd >= 0)
+        close_fd(w, file->fd);
+
+    /* A pipe with data left in it cannot be reused */
+    if (file->pipe.fd[0] >= 0) {
+        if (file->in_pipe == 0 && w->nr_pipes < MAX_CACHED_PIPES) {
+            w->pipes[w->nr_pipes++] = file->pipe;
+        } else {
+            close_fd(w, file->pipe.fd[0]);
+            close_fd(w, file->pipe.fd[1]);
+        }
+    }
+
+    if (file->aborted)
+        conn->shutdown = true;
+
+    conn->file = NULL;
+    cache_put(&w->file_cache, file);
+
+    if (!conn->shutdown)
+        handle_conn(conn);
+}
+
+static void send_file_headers(struct conn *conn)
+{
+    struct file_send *file = conn->file;
+
+    /* Earlier responses still own iov */
+    if (conn->writing)
+        return;
+
+    queue_response(conn, file->header, file->header_len);
+    file->state = FILE_HEADER;
+    flush_responses(conn);
+}
+
+static void add_splice_requests(struct conn *conn)
+{
+    struct worker *w = conn->worker;
+    struct file_send *file = conn->file;
+    struct io_uring_sqe *sqe;
+
+    file->state = FILE_BODY;
+
+    if (file->in_pipe > 0) {
+        sqe = get_sqe(w);
+        io_uring_prep_splice(sqe, file->pipe.fd[0], -1, conn->sock, -1, file->in_pipe, 0);
+        io_uring_sqe_set_flags(sqe, conn_sqe_flags());
+        set_user_data(sqe, conn, EVENT_TYPE_SPLICE_OUT);
+        file->pending = 1;
+        return;
+    }
+
+    if (file->off == file->size) {
+        end_file_request(conn);
+        return;
+    }
+
+    if (file->pipe.fd[0] < 0 && !get_pipe(w, &file->pipe)) {
+        file->aborted = true;
+        end_file_request(conn);
+        return;
+    }
+
+    unsigned len = file->size - file->off < file->pipe.size ? file->size - file->off : file->pipe.size;
+
+    reserve_sqes(w, 2);
+    sqe = get_sqe(w);
+    io_uring_prep_splice(sqe, file->fd, file->off, file->pipe.fd[1], -1, len, 0);
+    io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+    set_user_data(sqe, conn, EVENT_TYPE_SPLICE_IN);
+
+    sqe = get_sqe(w);
+    io_uring_prep_splice(sqe, file->pipe.fd[0], -1, conn->sock, -1, len, 0);
+    io_uring_sqe_set_flags(sqe, conn_sqe_flags());
+    set_user_data(sqe, conn, EVENT_TYPE_SPLICE_OUT);
+
+    file->pending = 2;
+}
+
+/* Completion of the open, then of the statx of the opened file */
+static void handle_open(struct conn *conn, struct io_uring_cqe *cqe, int type)
+{
+    struct file_send *file = conn->file;
+
+    file->pending--;
+    if (cqe->res < 0) {
+        file->missing = true;
+    } else if (type == EVENT_TYPE_OPEN) {
+        file->fd = cqe->res;
+        if (!file->aborted) {
+            struct io_uring_sqe *sqe = get_sqe(conn->worker);
+            io_uring_prep_statx(sqe, file->fd, "", AT_EMPTY_PATH, STATX_TYPE | STATX_SIZE | STATX_MTIME,
+                                &file->stx);
+            set_user_data(sqe, conn, EVENT_TYPE_STATX);
+            file->pending = 1;
+            return;
+        }
+    }
+
+    if (file->aborted) {
+        end_file_request(conn);
+        check_and_close_conn(conn);
+        return;
+    }
+
+    if (!file->missing && S_ISREG(file->stx.stx_mode)) {
+        char date[64];
+        time_t mtime = file->stx.stx_mtime.tv_sec;
+        struct tm tm;
+
+        strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&mtime, &tm));
+        file->size = file->stx.stx_size;
+        file->header_len = snprintf(file->header, sizeof(file->header),
+                                    "HTTP/1.1 200 OK\r\n"
+                                    "Server: Assdi2024Server/1.0\r\n"
+                                    "Content-Type: %s\r\n"
+                                    "Content-Length: %lld\r\n"
+                                    "Last-Modified: %s\r\n"
+                                    "\r\n",
+                                    content_type(file->path), (long long)file->size, date);
+    } else {
+        file->size = 0;
+        file->header_len = strlen(not_found);
+        memcpy(file->header, not_found, file->header_len);
+    }
+
+    file->state = FILE_READY;
+    send_file_headers(conn);
+    check_and_close_conn(conn);
+}
+
+static void handle_splice(struct conn *conn, struct io_uring_cqe *cqe, int type)
+{
+    struct file_send *file = conn->file;
+
+    if (type == EVENT_TYPE_SPLICE_IN) {
+        if (cqe->res > 0) {
+            file->off += cqe->res;
+            file->in_pipe += cqe->res;
+        } else {
+            /* The file shrank below the Content-Length already sent */
+            file->aborted = true;
+        }
+    } else if (cqe->res > 0) {
+        file->in_pipe -= cqe->res;
+        timer_stop(conn);
+    } else if (cqe->res != -ECANCELED) {
+        file->aborted = true;
+    }
+
+    if (--file->pending > 0)
+        return;
+
+    if (file->aborted)
+        end_file_request(conn);
+    else
+        add_splice_requests(conn);
+    check_and_close_conn(conn);
+}
+
+static void handle_read(struct conn *conn, struct io_uring_cqe* cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->reading = false;
+        conn->cancelling = false;
+    }
+
+    /*
+     * Provided buffers ran out; the recv is parked until some return. A
+     * connection holding some re-arms once they drain, as after a pause.
+     */
+    if ((cqe->res == -ENOBUFS || cqe->res == -ECANCELED) && !conn->shutdown) {
+        if (!conn->nr_held && cqe->res == -ENOBUFS)
+            park_read_request(conn);
+        else if (!conn->nr_held)
+            add_read_request(conn);
+        check_and_close_conn(conn);
+        return;
+    }
 
     if (cqe->res <= 0) {
         conn->shutdown = true;
@@ -223,83 +1477,410 @@ static void handle_read(struct io_uring_cqe* cqe)
         return;
     }
 
-    conn->buflen += cqe->res;
+    if (config.buf_ring) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!handle_buf_ring_data(conn, bid, cqe->res))
+            recycle_buffer(conn->worker, bid);
 
-    if (!conn->writing) {
-        handle_conn(conn);
+        if (!conn->reading && !conn->shutdown && !conn->nr_held)
+            add_read_request(conn);
+    } else {
+        conn->buflen += cqe->res;
+
+        if (!conn->writing) {
+            handle_conn(conn);
+        }
     }
 
     check_and_close_conn(conn);
 }
 
-static void handle_write(struct io_uring_cqe* cqe)
+static void handle_write(struct conn *conn, struct io_uring_cqe* cqe)
 {
-    struct req *request = io_uring_cqe_get_data(cqe);
-    struct conn *conn = request->conn;
+    if (cqe->flags & IORING_CQE_F_NOTIF) {
+        conn->zc_notifs--;
+        check_and_close_conn(conn);
+        return;
+    }
+
+    /* A zero-copy send completes twice, the notification follows */
+    if (cqe->flags & IORING_CQE_F_MORE)
+        conn->zc_notifs++;
+
     conn->writing = false;
 
     if (cqe->res <= 0) {
         conn->shutdown = true;
+        if (conn->file) {
+            conn->file->aborted = true;
+            if (!conn->file->pending)
+                end_file_request(conn);
+        }
         check_and_close_conn(conn);
         return;
     }
 
-    if (cqe->res < conn->sendbuf_sz) {
-        conn->sendbuf += cqe->res;
-        conn->sendbuf_sz -= cqe->res;
-        add_write_request(conn, conn->sendbuf, conn->sendbuf_sz);
-    } else if (!conn->shutdown && !conn->reading) {
+    /* Progress restarts the send timeout */
+    timer_stop(conn);
+
+    if (advance_msg(&conn->msg, cqe->res)) {
+        add_write_request(conn);
+    } else if (conn->file) {
+        if (conn->file->state == FILE_READY)
+            send_file_headers(conn);
+        else if (conn->file->state == FILE_HEADER)
+            add_splice_requests(conn);
+    } else if (!conn->shutdown && (config.buf_ring || !conn->reading)) {
+        /* A plain recv may still be targeting conn->buf */
         handle_conn(conn);
     }
 
     check_and_close_conn(conn);
 }
 
-void server_loop(int sock)
+/*
+ * Close every connection on the list whose deadline has passed. Its pending
+ * recv is cancelled and the connection closes once that completes.
+ */
+static void expire_conns(struct worker *w, struct conn_list *list, unsigned long *expired)
 {
-    struct io_uring ring;
+    while (list->head && list->head->deadline <= w->now) {
+        struct conn *conn = list->head;
 
-    io_uring_queue_init(QUEUE_DEPTH, &ring, 0);
-    add_accept_request(&ring, sock);
+        timer_stop(conn);
+        conn->shutdown = true;
+        (*expired)++;
+
+        if (conn->writing || conn->file)
+            shutdown_socket(conn);
+        else if (conn->reading && !conn->cancelling)
+            cancel_read_request(conn);
+        else
+            check_and_close_conn(conn);
+    }
+}
+
+static void report_stats(struct worker *w, struct timespec *now)
+{
+    double elapsed = (now->tv_sec - w->stats.last_report.tv_sec) +
+                     (now->tv_nsec - w->stats.last_report.tv_nsec) / 1e9;
+
+    printf("[worker %d] accepts/s: %.0f, idle timeouts: %lu, header timeouts: %lu, send timeouts: %lu, "
+           "sq full: %lu, cq backlog: %lu, cq dropped: %u\n",
+           w->id, w->stats.accepts / elapsed, w->stats.idle_timeouts, w->stats.header_timeouts,
+           w->stats.send_timeouts, w->stats.sq_full, w->stats.cq_backlog, *w->ring.cq.koverflow);
+    fflush(stdout);
+
+    w->stats.accepts = 0;
+    w->stats.last_report = *now;
+}
+
+/*
+ * Deadlines are kept in whole seconds of a clock that only advances here, so
+ * a connection may outlive its timeout by up to two seconds.
+ */
+static void handle_tick(struct worker *w)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    w->now = now.tv_sec;
+
+    expire_conns(w, &w->idle_list, &w->stats.idle_timeouts);
+    expire_conns(w, &w->header_list, &w->stats.header_timeouts);
+    expire_conns(w, &w->send_list, &w->stats.send_timeouts);
+
+    if (config.stats)
+        report_stats(w, &now);
+    add_tick_request(w);
+}
+
+void server_loop(struct worker *w)
+{
+    struct io_uring *ring = &w->ring;
+
+    add_accept_request(w);
+
+    clock_gettime(CLOCK_MONOTONIC, &w->stats.last_report);
+    w->now = w->stats.last_report.tv_sec;
+    if (config.stats || config.idle_timeout || config.header_timeout || config.send_timeout)
+        add_tick_request(w);
 
     while (1) {
         struct io_uring_cqe* cqe;
-        io_uring_submit_and_wait(&ring, 1);
 
-        while(io_uring_peek_cqe(&ring, &cqe) == 0) {
-            if (io_uring_sq_space_left(&ring) < MAX_SQE_PER_LOOP) {
-                break;
-            }
-
-            struct req *request = io_uring_cqe_get_data(cqe);
+        if (config.sqpoll) {
+            /*
+             * The SQ thread picks up new SQEs by itself; io_uring_submit only
+             * enters the kernel to wake it once it has gone idle and set
+             * IORING_SQ_NEED_WAKEUP. Block only when nothing has completed.
+             */
+            io_uring_submit(ring);
+            if (io_uring_peek_cqe(ring, &cqe) != 0)
+                io_uring_wait_cqe(ring, &cqe);
+        } else {
+            io_uring_submit_and_wait(ring, 1);
+        }
 
-            if (!request) {
-                io_uring_cqe_seen(&ring, cqe);
-                continue;
-            }
+        /*
+         * Completions that did not fit in the CQ wait in a kernel backlog
+         * and are flushed as the CQ drains; only a failed backlog
+         * allocation loses one, which the kernel counts in koverflow.
+         */
+        if (io_uring_cq_has_overflow(ring))
+            w->stats.cq_backlog++;
 
-            int type = request->type;
+        /* Drain every completion; get_sqe submits mid-batch if the SQ fills up */
+        while(io_uring_peek_cqe(ring, &cqe) == 0) {
+            __u64 user_data = io_uring_cqe_get_data64(cqe);
+            struct conn *conn = (struct conn *)(uintptr_t)(user_data & ~(__u64)EVENT_TYPE_MASK);
+            int type = user_data & EVENT_TYPE_MASK;
 
             switch(type) {
             case EVENT_TYPE_ACCEPT:
-                handle_accept(&ring, cqe);
-                add_accept_request(&ring, sock);
+                handle_accept(w, cqe);
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                    add_accept_request(w);
                 break;
             case EVENT_TYPE_READ:
-                handle_read(cqe);
+                handle_read(conn, cqe);
                 break;
             case EVENT_TYPE_WRITE:
-                handle_write(cqe);
+                handle_write(conn, cqe);
+                break;
+            case EVENT_TYPE_TICK:
+                handle_tick(w);
+                break;
+            case EVENT_TYPE_OPEN:
+            case EVENT_TYPE_STATX:
+                handle_open(conn, cqe, type);
+                break;
+            case EVENT_TYPE_SPLICE_IN:
+            case EVENT_TYPE_SPLICE_OUT:
+                handle_splice(conn, cqe, type);
                 break;
             }
 
-            io_uring_cqe_seen(&ring, cqe);
-            put_request(request);
+            io_uring_cqe_seen(ring, cqe);
         }
+
+        if (config.buf_ring)
+            resume_parked_reads(w);
+    }
+}
+
+static void setup_fixed_files(struct worker *w)
+{
+    struct rlimit rlim;
+    unsigned nr = MAX_FIXED_FILES;
+
+    /* The kernel refuses tables larger than the file descriptor limit */
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < nr)
+        nr = rlim.rlim_cur;
+
+    int ret = io_uring_register_files_sparse(&w->ring, nr);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_register_files_sparse: %s\n", strerror(-ret));
+        exit(1);
     }
 }
 
-static int setup_listening_socket(int port)
+static void probe_send_zc(struct io_uring *ring)
+{
+    struct io_uring_probe *probe = io_uring_get_probe_ring(ring);
+
+    if (!probe || !io_uring_opcode_supported(probe, IORING_OP_SEND_ZC) ||
+        !io_uring_opcode_supported(probe, IORING_OP_SENDMSG_ZC)) {
+        fprintf(stderr, "IORING_OP_SEND_ZC is not supported, using copying sends\n");
+        config.zc_threshold = 0;
+    }
+    if (probe)
+        io_uring_free_probe(probe);
+}
+
+/*
+ * Setup flags that are dropped one at a time, in this order, when the kernel
+ * rejects them. DEFER_TASKRUN needs SINGLE_ISSUER, so it goes first.
+ */
+static const unsigned optional_setup_flags[] = {
+    IORING_SETUP_DEFER_TASKRUN,
+    IORING_SETUP_SINGLE_ISSUER,
+    IORING_SETUP_COOP_TASKRUN,
+    IORING_SETUP_ATTACH_WQ,
+};
+
+static int queue_init_fallback(struct io_uring *ring, struct io_uring_params *params)
+{
+    int ret = io_uring_queue_init_params(config.sq_entries, ring, params);
+
+    for (size_t i = 0; ret == -EINVAL && i < sizeof(optional_setup_flags) / sizeof(optional_setup_flags[0]); i++) {
+        if (!(params->flags & optional_setup_flags[i]))
+            continue;
+        params->flags &= ~optional_setup_flags[i];
+        ret = io_uring_queue_init_params(config.sq_entries, ring, params);
+    }
+
+    return ret;
+}
+
+/*
+ * The low-overhead profile only runs completion task_work when the worker
+ * asks for events, and registers the ring fd so io_uring_enter skips the
+ * fd lookup. SQPOLL rings only accept SINGLE_ISSUER out of the profile.
+ */
+static void report_ring_profile(struct worker *w, struct io_uring_params *params, bool ring_fd_registered)
+{
+    if (w->id > 0)
+        return;
+
+    printf("Ring profile:%s%s%s%s\n",
+           params->flags & IORING_SETUP_SINGLE_ISSUER ? " SINGLE_ISSUER" : "",
+           params->flags & IORING_SETUP_DEFER_TASKRUN ? " DEFER_TASKRUN" : "",
+           params->flags & IORING_SETUP_COOP_TASKRUN ? " COOP_TASKRUN" : "",
+           ring_fd_registered ? " registered-ring-fd" : "");
+    fflush(stdout);
+}
+
+/*
+ * With NAPI registered, waiting for completions busy polls the receive
+ * queues of the ring's sockets for up to napi_busy_poll_to microseconds
+ * before sleeping, trading CPU for wakeup latency. Only devices that use
+ * NAPI benefit; loopback has none.
+ */
+static void setup_napi(struct worker *w)
+{
+#ifdef HAVE_IO_URING_NAPI
+    struct io_uring_napi napi;
+
+    memset(&napi, 0, sizeof(napi));
+    napi.busy_poll_to = config.napi_busy_poll_to;
+    napi.prefer_busy_poll = config.napi_prefer_busy_poll;
+
+    int ret = io_uring_register_napi(&w->ring, &napi);
+    if (ret < 0 && w->id == 0)
+        fprintf(stderr, "io_uring_register_napi: %s, NAPI busy polling is off\n", strerror(-ret));
+#else
+    if (w->id == 0)
+        fprintf(stderr, "liburing is too old for NAPI busy polling (needs 2.6), ignoring -N\n");
+#endif
+}
+
+/*
+ * Rings after the first attach to the first ring's async worker pool, so
+ * all workers share one set of io-wq threads. With SQPOLL, attaching also
+ * shares the first ring's SQ thread, so it is only done when asked for.
+ */
+static void worker_init(struct worker *w)
+{
+    struct io_uring_params params;
+    int ret;
+
+    memset(&params, 0, sizeof(params));
+    /* Sizes above the kernel limits are clamped rather than refused */
+    params.flags |= IORING_SETUP_CLAMP;
+    if (config.cq_entries) {
+        params.flags |= IORING_SETUP_CQSIZE;
+        params.cq_entries = config.cq_entries;
+    }
+
+    if (config.sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = config.sq_thread_idle;
+        if (config.sq_thread_cpu >= 0) {
+            params.flags |= IORING_SETUP_SQ_AFF;
+            params.sq_thread_cpu = config.sq_thread_cpu + (config.sq_thread_shared ? 0 : w->id);
+        }
+    }
+
+    if (w->id > 0 && (!config.sqpoll || config.sq_thread_shared)) {
+        params.flags |= IORING_SETUP_ATTACH_WQ;
+        params.wq_fd = workers[0].ring.ring_fd;
+    }
+
+    if (config.low_overhead) {
+        params.flags |= IORING_SETUP_SINGLE_ISSUER;
+        if (!config.sqpoll)
+            params.flags |= IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_COOP_TASKRUN;
+    }
+
+    ret = queue_init_fallback(&w->ring, &params);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_queue_init_params: %s\n", strerror(-ret));
+        exit(1);
+    }
+
+    if (w->id == 0) {
+        printf("Ring size: %u SQ entries, %u CQ entries\n", params.sq_entries, params.cq_entries);
+        fflush(stdout);
+    }
+
+    if (config.low_overhead) {
+        /* Registered ring fds are per thread, so every worker registers its own */
+        bool registered = io_uring_register_ring_fd(&w->ring) == 1;
+        report_ring_profile(w, &params, registered);
+    }
+
+    /* Workers start one at a time, so only the first one probes */
+    if (w->id == 0 && config.zc_threshold)
+        probe_send_zc(&w->ring);
+
+    if (config.napi_busy_poll_to)
+        setup_napi(w);
+
+    w->multishot_accept = config.multishot_accept;
+    if (config.buf_ring)
+        setup_buf_ring(w);
+    if (config.fixed_files)
+        setup_fixed_files(w);
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *w = arg;
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(w->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+        fprintf(stderr, "worker %d: failed to pin to cpu %d\n", w->id, w->cpu);
+
+    worker_init(w);
+    sem_post(&worker_ready);
+
+    server_loop(w);
+    return NULL;
+}
+
+/* Start one pinned worker per thread, spreading them over the allowed CPUs */
+static void start_workers(void)
+{
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE], ncpus = 0;
+
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed))
+            cpus[ncpus++] = cpu;
+    }
+
+    sem_init(&worker_ready, 0, 0);
+
+    for (int i = 0; i < config.threads; i++) {
+        struct worker *w = &workers[i];
+        w->cpu = cpus[i % ncpus];
+
+        if (pthread_create(&w->thread, NULL, worker_thread, w) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        /* The next ring attaches to this one, so wait until it exists */
+        sem_wait(&worker_ready);
+    }
+
+    for (int i = 0; i < config.threads; i++)
+        pthread_join(workers[i].thread, NULL);
+}
+
+static int setup_listening_socket(int port, bool reuseport)
 {
     int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
     if (listen_sock < 0) {
@@ -308,6 +1889,14 @@ static int setup_listening_socket(int port)
     }
 
     setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+    if (reuseport)
+        setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int));
+    /*
+     * Accepted sockets inherit this. A batch of pipelined responses can go
+     * out in several sends, and Nagle would hold back all but the first
+     * until the client's delayed ACK.
+     */
+    setsockopt(listen_sock, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
 
     struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
@@ -327,22 +1916,190 @@ static int setup_listening_socket(int port)
     return listen_sock;
 }
 
+/* Replace the hello page with a response carrying a body of the given size */
+static void build_response(int body_size)
+{
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 200 OK\r\n"
+                              "Server: Assdi2024Server/1.0\r\n"
+                              "Content-Type: application/octet-stream\r\n"
+                              "Content-Length: %d\r\n"
+                              "\r\n", body_size);
+
+    char *buf = malloc(header_len + body_size);
+    memcpy(buf, header, header_len);
+    memset(buf + header_len, 'x', body_size);
+
+    response = buf;
+    response_len = header_len + body_size;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-t threads] [-q entries] [-Q entries] [-m] [-b] [-f]\n"
+                    "          [-P [-C cpu] [-I ms] [-S]] [-L] [-N usecs [-B]] [-z bytes] [-R bytes]\n"
+                    "          [-d docroot] [-k secs] [-H secs] [-w secs] [-s] [port]\n"
+                    "  -t  number of pinned worker threads, each with its own\n"
+                    "      ring and SO_REUSEPORT listener (default 1)\n"
+                    "  -q  SQ entries per ring (default %d)\n"
+                    "  -Q  CQ entries per ring (default twice the SQ entries)\n"
+                    "  -m  use multishot accept\n"
+                    "  -b  use a provided-buffer ring with multishot recv\n"
+                    "  -f  accept into a registered file table and use fixed files\n"
+                    "  -P  use a kernel SQ polling thread (IORING_SETUP_SQPOLL)\n"
+                    "  -C  pin the SQ thread to this cpu; with several unshared\n"
+                    "      SQ threads, worker n uses cpu + n\n"
+                    "  -I  SQ thread idle time in milliseconds before it sleeps\n"
+                    "  -S  share one SQ thread between all worker rings\n"
+                    "  -L  use the low-overhead ring profile (single issuer, deferred\n"
+                    "      task_work, registered ring fd) where the kernel supports it\n"
+                    "  -N  busy poll NAPI for this many microseconds when waiting\n"
+                    "  -B  prefer busy polling over interrupts (with -N)\n"
+                    "  -z  use zero-copy sends (IORING_OP_SEND_ZC) for responses of\n"
+                    "      at least this many bytes\n"
+                    "  -R  respond with a body of this many bytes instead of the hello page\n"
+                    "  -d  serve static files from this directory\n"
+                    "  -k  close keep-alive connections idle for this many seconds,\n"
+                    "      0 disables (default %d)\n"
+                    "  -H  close connections that take longer than this many seconds\n"
+                    "      to send a request, 0 disables (default %d)\n"
+                    "  -w  close connections whose responses make no progress for\n"
+                    "      this many seconds, 0 disables (default %d)\n"
+                    "  -s  report statistics every second\n",
+            prog, QUEUE_DEPTH, DEFAULT_IDLE_TIMEOUT, DEFAULT_HEADER_TIMEOUT, DEFAULT_SEND_TIMEOUT);
+    exit(1);
+}
+
 int main(int argc, char *argv[])
 {
-    int port = DEFAULT_SERVER_PORT;
-    if (argc > 1)
-        port = atoi(argv[1]);
+    int opt;
+    while ((opt = getopt(argc, argv, "t:q:Q:mbfPC:I:SLN:Bz:R:d:k:H:w:s")) != -1) {
+        switch (opt) {
+        case 't':
+            config.threads = atoi(optarg);
+            if (config.threads < 1)
+                usage(argv[0]);
+            break;
+        case 'q':
+            config.sq_entries = atoi(optarg);
+            if (config.sq_entries < MIN_SQ_ENTRIES)
+                usage(argv[0]);
+            break;
+        case 'Q':
+            config.cq_entries = atoi(optarg);
+            break;
+        case 'm':
+            config.multishot_accept = true;
+            break;
+        case 'b':
+            config.buf_ring = true;
+            break;
+        case 'f':
+            config.fixed_files = true;
+            break;
+        case 'P':
+            config.sqpoll = true;
+            break;
+        case 'C':
+            config.sq_thread_cpu = atoi(optarg);
+            break;
+        case 'I':
+            config.sq_thread_idle = atoi(optarg);
+            break;
+        case 'S':
+            config.sq_thread_shared = true;
+            break;
+        case 'L':
+            config.low_overhead = true;
+            break;
+        case 'N':
+            config.napi_busy_poll_to = atoi(optarg);
+            break;
+        case 'B':
+            config.napi_prefer_busy_poll = true;
+            break;
+        case 'z':
+            config.zc_threshold = atoi(optarg);
+            break;
+        case 'R':
+            config.response_size = atoi(optarg);
+            break;
+        case 'd':
+            config.docroot = optarg;
+            break;
+        case 'k':
+            config.idle_timeout = atoi(optarg);
+            break;
+        case 'H':
+            config.header_timeout = atoi(optarg);
+            break;
+        case 'w':
+            config.send_timeout = atoi(optarg);
+            break;
+        case 's':
+            config.stats = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
 
-    int sock = setup_listening_socket(port);
+    if (optind < argc)
+        config.port = atoi(argv[optind]);
 
-    /* Add Empty Requests */
-    for (int i = 0; i < MAX_REQUEST; i++) {
-        struct req *request = calloc(1, sizeof(*request));
-        put_request(request);
+    if (config.docroot) {
+        docroot_fd = open(config.docroot, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (docroot_fd < 0) {
+            perror("open docroot");
+            exit(1);
+        }
     }
 
-    printf("Listening on port %d\n", port);
-    server_loop(sock);
+    if (config.response_size > 0)
+        build_response(config.response_size);
+    else
+        response_len = strlen(response);
+
+    workers = calloc(config.threads, sizeof(*workers));
+    for (int i = 0; i < config.threads; i++) {
+        workers[i].id = i;
+        workers[i].sock = setup_listening_socket(config.port, config.threads > 1);
+    }
+
+    printf("Listening on port %d\n", config.port);
+    if (config.threads > 1)
+        printf("Using %d worker threads\n", config.threads);
+    if (config.multishot_accept)
+        printf("Using multishot accept\n");
+    if (config.buf_ring)
+        printf("Using provided-buffer ring (%d x %d bytes) with multishot recv\n",
+               BUF_RING_ENTRIES, BUF_RING_BUF_SZ);
+    if (config.fixed_files)
+        printf("Using registered file table with direct accept\n");
+    if (config.docroot)
+        printf("Serving static files from %s\n", config.docroot);
+    if (config.zc_threshold)
+        printf("Using zero-copy sends for responses of %d bytes or more\n", config.zc_threshold);
+    if (config.sqpoll) {
+        printf("Using SQPOLL: %s SQ thread, cpu %d, idle %d ms\n",
+               config.sq_thread_shared ? "shared" : "per-ring",
+               config.sq_thread_cpu, config.sq_thread_idle);
+    }
+    if (config.napi_busy_poll_to) {
+        printf("Using NAPI busy polling: %d us%s\n", config.napi_busy_poll_to,
+               config.napi_prefer_busy_poll ? ", prefer busy poll" : "");
+    }
+    printf("Timeouts: idle %d s, header %d s, send %d s\n", config.idle_timeout, config.header_timeout,
+           config.send_timeout);
+    fflush(stdout);
+
+    if (config.threads > 1) {
+        start_workers();
+    } else {
+        worker_init(&workers[0]);
+        server_loop(&workers[0]);
+    }
     fprintf(stderr, "server exiting\n");
     return 0;
 }
@@ -59,6 +59,35 @@ int phr_parse_response(const char *_buf, size_t len, int *minor_version, int *st
 /* ditto */
 int phr_parse_headers(const char *buf, size_t len, struct phr_header *headers, size_t *num_headers, size_t last_len);
 
+/* request headers that phr_parse_request_indexed locates while it parses */
+enum {
+    PHR_HEADER_HOST,
+    PHR_HEADER_CONNECTION,
+    PHR_HEADER_CONTENT_LENGTH,
+    PHR_HEADER_TRANSFER_ENCODING,
+    PHR_HEADER_ACCEPT_ENCODING,
+    PHR_HEADER_IF_NONE_MATCH,
+    PHR_NUM_KNOWN_HEADERS
+};
+
+struct phr_header_index {
+    int first[PHR_NUM_KNOWN_HEADERS]; /* position in headers of the first occurrence, or -1 */
+    unsigned repeated;                /* bit (1 << PHR_HEADER_*) set if the header occurs more than once */
+};
+
+/* same as phr_parse_request, and also fills in the index of well-known
+ * headers in the same pass, matching names case-insensitively */
+int phr_parse_request_indexed(const char *buf, size_t len, const char **method, size_t *method_len, const char **path,
+                              size_t *path_len, int *minor_version, struct phr_header *headers, size_t *num_headers, size_t last_len,
+                              struct phr_header_index *index);
+
+/* returns the first occurrence of a well-known header, or NULL if the
+ * request did not have it */
+static inline const struct phr_header *phr_find_header(const struct phr_header *headers, const struct phr_header_index *index, int id)
+{
+    return index->first[id] < 0 ? NULL : &headers[index->first[id]];
+}
+
 /* should be zero-filled before start */
 struct phr_chunked_decoder {
     size_t bytes_left_in_chunk; /* number of bytes left in current chunk */
@@ -1,14 +1,22 @@
 #include <stdio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <errno.h>
 #include <liburing.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/utsname.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <time.h>
 #include "picohttpparser.h"
 
 #define SERVER_STRING           "Server: zerohttpd/0.1\r\n"
@@ -25,6 +33,57 @@
 
 #define MAX_SQE_PER_LOOP        5
 
+/* Pipelined requests answered by a single writev */
+#define MAX_BATCH               16
+
+/* Prefork pool maintenance, as in Apache's prefork MPM */
+#define MAINTENANCE_INTERVAL_MS 1000
+#define MAX_SPAWN_RATE          32
+#define DEFAULT_MIN_SPARE       2
+#define DEFAULT_MAX_SPARE       8
+
+struct server_config {
+    int port;
+    int workers;
+    int max_workers;
+    int min_spare;
+    int max_spare;
+    bool reuseport;
+    int max_conns;
+};
+
+static struct server_config config = {
+    .port = DEFAULT_SERVER_PORT,
+    .min_spare = DEFAULT_MIN_SPARE,
+    .max_spare = DEFAULT_MAX_SPARE,
+};
+
+enum {
+    SLOT_EMPTY,
+    SLOT_IDLE,
+    SLOT_BUSY,
+};
+
+/*
+ * Scoreboard entry, in memory shared between the supervisor and the
+ * workers. A worker only writes state and its counters; the supervisor
+ * fills a slot in when it spawns a worker and asks it to retire.
+ */
+struct slot {
+    pid_t pid;
+    int state;
+    bool retire;
+    unsigned long conns;
+    unsigned long requests;
+};
+
+static struct slot *scoreboard;
+/* This worker's scoreboard entry, NULL when forking per connection */
+static struct slot *my_slot;
+static pid_t supervisor;
+static volatile sig_atomic_t retiring;
+static volatile sig_atomic_t dump_requested;
+
 static const char* response =
             "HTTP/1.1 200 OK\r\n"
             "Server: Assdi2024Server/1.0\r\n"
@@ -32,6 +91,7 @@ static const char* response =
             "Content-Length: 98\r\n"
             "\r\n"
             "<!DOCTYPE html><head><title>Hello, World!</title></head><body><h1>Hello, World!</h1></body></html>";
+static size_t response_len;
 
 static const char* bad_request =
             "HTTP/1.1 400 Bad Request\r\n"
@@ -42,9 +102,46 @@ static const char* bad_request =
             "\r\n"
             "<!DOCTYPE html><head><title>Bad Request!</title></head><body><h1>Bad Request!</h1></body></html>";
 
-static bool should_close_connection(struct phr_header *headers, size_t num_headers)
+static const char* continue_response = "HTTP/1.1 100 Continue\r\n\r\n";
+
+enum {
+    BODY_NONE,
+    BODY_LENGTH,
+    BODY_CHUNKED,
+};
+
+/* The body of the request being served */
+struct body {
+    int sock;
+    int kind;
+    unsigned long long left;    /* BODY_LENGTH: bytes not read yet */
+    struct phr_chunked_decoder decoder;
+};
+
+/*
+ * Endpoint that consumes a request body. start is called while the request
+ * headers are still valid, data with every window of decoded body in the
+ * receive buffer, and end once the body is complete. Each returns false if
+ * the connection has to be closed.
+ */
+struct body_handler {
+    bool (*start)(struct body *body, const struct phr_header *headers, size_t num_headers);
+    bool (*data)(struct body *body, const char *data, size_t len);
+    bool (*end)(struct body *body);
+};
+
+static bool should_close_connection(const struct phr_header *headers, size_t num_headers,
+                                    const struct phr_header_index *index)
 {
-    for (size_t i = 0; i < num_headers; i++) {
+    const struct phr_header *hdr = phr_find_header(headers, index, PHR_HEADER_CONNECTION);
+
+    if (!hdr)
+        return false;
+    if (!(index->repeated & (1u << PHR_HEADER_CONNECTION)))
+        return hdr->value_len == 5 && strncasecmp(hdr->value, "close", 5) == 0;
+
+    /* Repeated Connection headers are rare enough to scan for */
+    for (size_t i = hdr - headers; i < num_headers; i++) {
         if (headers[i].name_len == 10 && strncasecmp(headers[i].name, "connection", 10) == 0) {
             if (headers[i].value_len == 5 && strncasecmp(headers[i].value, "close", 5) == 0)
                 return true;
@@ -53,7 +150,50 @@ static bool should_close_connection(struct phr_header *headers, size_t num_heade
     return false;
 }
 
-static int setup_listening_socket(int port)
+static bool expects_continue(const struct phr_header *headers, size_t num_headers)
+{
+    for (size_t i = 0; i < num_headers; i++) {
+        if (headers[i].name_len == 6 && strncasecmp(headers[i].name, "expect", 6) == 0)
+            return headers[i].value_len == 12 && strncasecmp(headers[i].value, "100-continue", 12) == 0;
+    }
+    return false;
+}
+
+/*
+ * Work out how the request body is framed. Conflicting or repeated framing
+ * headers, a transfer coding other than chunked and a malformed length are
+ * refused, as something in front of the server might frame the body
+ * differently. Returns BODY_NONE, BODY_LENGTH with *length set, BODY_CHUNKED
+ * or -1.
+ */
+static int body_framing(const struct phr_header *headers, const struct phr_header_index *index,
+                        unsigned long long *length)
+{
+    const struct phr_header *te = phr_find_header(headers, index, PHR_HEADER_TRANSFER_ENCODING);
+    const struct phr_header *cl = phr_find_header(headers, index, PHR_HEADER_CONTENT_LENGTH);
+
+    if (index->repeated & ((1u << PHR_HEADER_TRANSFER_ENCODING) | (1u << PHR_HEADER_CONTENT_LENGTH)))
+        return -1;
+    if (te && cl)
+        return -1;
+    if (te)
+        return te->value_len == 7 && strncasecmp(te->value, "chunked", 7) == 0 ? BODY_CHUNKED : -1;
+    if (!cl)
+        return BODY_NONE;
+
+    /* 18 digits cannot overflow */
+    if (cl->value_len == 0 || cl->value_len > 18)
+        return -1;
+    *length = 0;
+    for (size_t i = 0; i < cl->value_len; i++) {
+        if (!isdigit((unsigned char)cl->value[i]))
+            return -1;
+        *length = *length * 10 + (cl->value[i] - '0');
+    }
+    return *length ? BODY_LENGTH : BODY_NONE;
+}
+
+static int setup_listening_socket(int port, bool reuseport)
 {
     int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
     if (listen_sock < 0) {
@@ -62,6 +202,14 @@ static int setup_listening_socket(int port)
     }
 
     setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+    if (reuseport)
+        setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int));
+    /*
+     * Accepted sockets inherit this. A batch of pipelined responses can go
+     * out in several sends, and Nagle would hold back all but the first
+     * until the client's delayed ACK.
+     */
+    setsockopt(listen_sock, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
 
     struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
@@ -81,93 +229,463 @@ static int setup_listening_socket(int port)
     return listen_sock;
 }
 
-static void send_bad_request(int sock)
+/* Returns false if the connection broke */
+static bool send_responses(int sock, struct iovec *iov, int iovcnt)
 {
-    const char *buf = bad_request;
-    size_t buflen = strlen(buf);
+    while (iovcnt > 0) {
+        ssize_t sret = writev(sock, iov, iovcnt);
+        if (sret < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
 
-    while (buflen > 0) {
-        ssize_t sret = send(sock, buf, buflen, 0);
-        if (sret < 0)
-            return;
-        buf += sret;
-        buflen -= sret;
+        while (iovcnt > 0 && (size_t)sret >= iov->iov_len) {
+            sret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + sret;
+            iov->iov_len -= sret;
+        }
     }
+    return true;
 }
 
-static void send_response(int sock)
+/*
+ * POST /echo: send the body straight back, framed the way it came in, one
+ * chunk per window when it came chunked.
+ */
+static bool echo_start(struct body *body, const struct phr_header *headers, size_t num_headers)
 {
-    const char *buf = response;
-    size_t buflen = strlen(buf);
+    char head[256];
+    int len = 0;
 
-    while (buflen > 0) {
-        ssize_t sret = send(sock, buf, buflen, 0);
-        if (sret < 0)
-            return;
-        buf += sret;
-        buflen -= sret;
+    if (expects_continue(headers, num_headers))
+        len = snprintf(head, sizeof(head), "%s", continue_response);
+    len += snprintf(head + len, sizeof(head) - len,
+                    "HTTP/1.1 200 OK\r\n"
+                    "Server: Assdi2024Server/1.0\r\n"
+                    "Content-Type: application/octet-stream\r\n");
+    if (body->kind == BODY_CHUNKED)
+        len += snprintf(head + len, sizeof(head) - len, "Transfer-Encoding: chunked\r\n\r\n");
+    else
+        len += snprintf(head + len, sizeof(head) - len, "Content-Length: %llu\r\n\r\n", body->left);
+
+    struct iovec iov = { .iov_base = head, .iov_len = len };
+    return send_responses(body->sock, &iov, 1);
+}
+
+static bool echo_data(struct body *body, const char *data, size_t len)
+{
+    char size[32];
+    struct iovec iov[3];
+    int iovcnt = 0;
+
+    if (body->kind == BODY_CHUNKED)
+        iov[iovcnt++] = (struct iovec){ .iov_base = size, .iov_len = snprintf(size, sizeof(size), "%zx\r\n", len) };
+    iov[iovcnt++] = (struct iovec){ .iov_base = (void *)data, .iov_len = len };
+    if (body->kind == BODY_CHUNKED)
+        iov[iovcnt++] = (struct iovec){ .iov_base = "\r\n", .iov_len = 2 };
+    return send_responses(body->sock, iov, iovcnt);
+}
+
+static bool echo_end(struct body *body)
+{
+    if (body->kind != BODY_CHUNKED)
+        return true;
+
+    struct iovec iov = { .iov_base = "0\r\n\r\n", .iov_len = 5 };
+    return send_responses(body->sock, &iov, 1);
+}
+
+static const struct body_handler echo_handler = { echo_start, echo_data, echo_end };
+
+static const struct body_handler *find_body_handler(const char *method, size_t method_len,
+                                                    const char *path, size_t path_len)
+{
+    if (method_len == 4 && memcmp(method, "POST", 4) == 0 && path_len == 5 && memcmp(path, "/echo", 5) == 0)
+        return &echo_handler;
+    return NULL;
+}
+
+/*
+ * Feed the body at the start of buf to the handler a window at a time,
+ * receiving the next window into buf once the handler is done with the
+ * last, so a body of any size passes through BUF_SZ bytes. Afterwards buf
+ * holds whatever followed the body. Returns false if the connection has
+ * to be closed.
+ */
+static bool stream_body(struct body *body, const struct body_handler *handler, char *buf, size_t *buflen)
+{
+    size_t len = *buflen, n;
+    ssize_t rest;
+
+    while (1) {
+        if (body->kind == BODY_LENGTH) {
+            n = len < body->left ? len : body->left;
+            body->left -= n;
+            rest = len - n;
+        } else {
+            n = len;
+            rest = phr_decode_chunked(&body->decoder, buf, &n);
+            if (rest == -1)
+                return false;
+        }
+
+        if (n > 0 && !handler->data(body, buf, n))
+            return false;
+        if (body->kind == BODY_LENGTH ? body->left == 0 : rest >= 0)
+            break;
+
+        ssize_t rret;
+        do {
+            rret = recv(body->sock, buf, BUF_SZ, 0);
+        } while (rret < 0 && errno == EINTR);
+        if (rret <= 0)
+            return false;
+        len = rret;
     }
+
+    memmove(buf, buf + n, rest);
+    *buflen = rest;
+    return handler->end(body);
 }
 
+/*
+ * Answer every complete request in the buffer after each read, with one
+ * writev per batch of pipelined requests. A request with a body is only
+ * accepted by an endpoint that streams it; earlier responses go out first.
+ */
 static void handle_client(int sock)
 {
     char buf[BUF_SZ];
     size_t buflen = 0, prevbuflen;
+    struct iovec iov[MAX_BATCH];
+    struct body body = { .sock = sock };
 
     while (1) {
         /* Receive Request */
         ssize_t rret = recv(sock, buf + buflen, BUF_SZ - buflen, 0);
 
+        /* A retiring worker finishes the connection it is serving */
+        if (rret < 0 && errno == EINTR)
+            continue;
         if (rret < 0 || (rret == 0 && buflen == 0))
             break;
 
         prevbuflen = buflen;
         buflen += rret;
 
-        struct phr_header headers[50];
-        const char *method, *path;
-        size_t method_len, path_len, num_headers = 50;
-        int minor_version;
+        size_t consumed = 0;
+        int iovcnt = 0, pret;
+        bool cont = true;
+
+        while (cont) {
+            struct phr_header headers[50];
+            struct phr_header_index index;
+            const char *method, *path;
+            size_t method_len, path_len, num_headers = 50;
+            int minor_version;
+
+            pret = phr_parse_request_indexed(buf + consumed, buflen - consumed, &method, &method_len,
+                                             &path, &path_len, &minor_version, headers, &num_headers,
+                                             prevbuflen, &index);
+            if (pret < 0)
+                break;
+
+            cont = minor_version == 1 && !should_close_connection(headers, num_headers, &index);
+
+            const struct body_handler *handler = find_body_handler(method, method_len, path, path_len);
+            body.left = 0;
+            body.kind = body_framing(headers, &index, &body.left);
+            if ((!handler && (method_len != 3 || memcmp(method, "GET", 3) != 0)) ||
+                body.kind < 0 || (body.kind != BODY_NONE && !handler)) {
+                pret = -1;
+                break;
+            }
+
+            /* Request is complete */
+            if (my_slot)
+                my_slot->requests++;
+            consumed += pret;
+            prevbuflen = 0;
+
+            if (handler) {
+                if (!send_responses(sock, iov, iovcnt))
+                    return;
+                iovcnt = 0;
+                if (body.kind == BODY_NONE)
+                    body.kind = BODY_LENGTH;
+                memset(&body.decoder, 0, sizeof(body.decoder));
+                body.decoder.consume_trailer = 1;
+                if (!handler->start(&body, headers, num_headers))
+                    return;
+
+                memmove(buf, buf + consumed, buflen - consumed);
+                buflen -= consumed;
+                consumed = 0;
+                if (!stream_body(&body, handler, buf, &buflen))
+                    return;
+                continue;
+            }
+
+            iov[iovcnt++] = (struct iovec){ .iov_base = (void *)response, .iov_len = response_len };
+
+            if (iovcnt == MAX_BATCH) {
+                if (!send_responses(sock, iov, iovcnt))
+                    return;
+                iovcnt = 0;
+            }
+        }
+
+        /* request is too long */
+        if (pret == -2 && buflen - consumed == BUF_SZ)
+            pret = -1;
 
-        int pret = phr_parse_request(buf, buflen, &method, &method_len, &path, &path_len,
-                                     &minor_version, headers, &num_headers, prevbuflen);
         if (pret == -1) {
             /* parse error */
-            send_bad_request(sock);
+            iov[iovcnt++] = (struct iovec){ .iov_base = (void *)bad_request, .iov_len = strlen(bad_request) };
+            cont = false;
+        }
+
+        if (!send_responses(sock, iov, iovcnt))
+            return;
+
+        if (!cont)
             break;
-        } else if (pret == -2) {
-            /* request is incomplete */
-            if (buflen == BUF_SZ) {
-                /* request is too long */
-                send_bad_request(sock);
-                break;
-            }
-            if (rret == 0) /* EOF */
-                break;
+        if (rret == 0) /* EOF */
+            break;
+
+        memmove(buf, buf + consumed, buflen - consumed);
+        buflen -= consumed;
+    }
+}
+
+static void handle_retire(int sig)
+{
+    (void)sig;
+    retiring = 1;
+}
+
+static void handle_dump(int sig)
+{
+    (void)sig;
+    dump_requested = 1;
+}
+
+/* Only there so that SIGCHLD interrupts the supervisor's sleep */
+static void handle_child(int sig)
+{
+    (void)sig;
+}
+
+/*
+ * Serve connections one at a time until told to retire or the recycling
+ * limit, if any. SIGTERM is handled without SA_RESTART so that it wakes
+ * an idle worker from accept, but a busy one finishes its connection.
+ * A SIGTERM that lands just before accept is caught by the accept
+ * timeout, so an idle worker retires within a maintenance interval.
+ */
+static void worker_loop(int sock)
+{
+    struct timeval tv = { .tv_sec = MAINTENANCE_INTERVAL_MS / 1000,
+                          .tv_usec = MAINTENANCE_INTERVAL_MS % 1000 * 1000 };
+
+    sigaction(SIGTERM, &(struct sigaction){ .sa_handler = handle_retire }, NULL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGUSR1, SIG_IGN);
+    /* Don't outlive the parent, not even to finish a connection */
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != supervisor)
+        exit(0);
+    /* Let a reset peer fail the writev */
+    signal(SIGPIPE, SIG_IGN);
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        perror("setsockopt(SO_RCVTIMEO)");
+        exit(1);
+    }
+
+    while (!retiring && (!config.max_conns || my_slot->conns < (unsigned long)config.max_conns)) {
+        my_slot->state = SLOT_IDLE;
+        int client_sock = accept(sock, NULL, NULL);
+        if (client_sock < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+                perror("accept");
             continue;
         }
 
-        bool cont = minor_version == 1 && !should_close_connection(headers, num_headers);
+        /* Accepted sockets inherit the listener's timeout */
+        setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, &(struct timeval){ 0 }, sizeof(struct timeval));
 
-        /* Request is complete */
-        send_response(sock);
-        memmove(buf, buf + pret, buflen - pret);
-        buflen -= pret;
-        prevbuflen = 0;
+        my_slot->state = SLOT_BUSY;
+        my_slot->conns++;
+        handle_client(client_sock);
+        close(client_sock);
+    }
+}
 
-        if (!cont)
+/*
+ * With SO_REUSEPORT every worker slot has its own listener, opened by the
+ * parent so that a replacement worker picks up the connections queued for
+ * the one it replaces.
+ */
+static void spawn_worker(int *socks, int slot)
+{
+    struct slot *s = &scoreboard[slot];
+    pid_t pid;
+
+    /* Counted as idle from the start so one tick does not spawn twice */
+    *s = (struct slot){ .state = SLOT_IDLE };
+
+    while ((pid = fork()) == -1) {
+        perror("fork");
+        sleep(1);
+    }
+
+    if (pid == 0) {
+        my_slot = s;
+        if (config.reuseport) {
+            for (int i = 0; i < config.max_workers; i++) {
+                if (i != slot)
+                    close(socks[i]);
+            }
+        }
+        worker_loop(socks[config.reuseport ? slot : 0]);
+        exit(0);
+    }
+    s->pid = pid;
+}
+
+static void spawn_workers(int *socks, int n)
+{
+    for (int i = 0; i < config.max_workers && n > 0; i++) {
+        if (scoreboard[i].state == SLOT_EMPTY) {
+            spawn_worker(socks, i);
+            n--;
+        }
+    }
+}
+
+/* Requests served by workers that have since exited */
+static unsigned long retired_requests;
+
+/*
+ * Workers that were recycled or died are replaced in the same slot right
+ * away; retired ones leave their slot empty.
+ */
+static void reap_workers(int *socks)
+{
+    int status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < config.max_workers; i++) {
+            struct slot *s = &scoreboard[i];
+            if (s->state == SLOT_EMPTY || s->pid != pid)
+                continue;
+
+            retired_requests += s->requests;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                fprintf(stderr, "worker %d (pid %d) died, restarting\n", i, pid);
+
+            if (s->retire)
+                s->state = SLOT_EMPTY;
+            else
+                spawn_worker(socks, i);
             break;
+        }
     }
 }
 
-int main(int argc, char *argv[])
+/*
+ * Keep between min_spare and max_spare workers idle, within the pool's
+ * bounds. Spawning doubles each tick that is still short of idle workers,
+ * up to MAX_SPAWN_RATE; retiring goes one worker per tick. The gap between
+ * the two thresholds keeps the pool from flapping around a steady load.
+ */
+static void maintain_pool(int *socks)
 {
-    int port = DEFAULT_SERVER_PORT;
-    if (argc > 1)
-        port = atoi(argv[1]);
+    static int spawn_rate = 1;
+    int total = 0, idle = 0, last_idle = -1;
 
-    int sock = setup_listening_socket(port);
-    printf("Listening on port %d\n", port);
+    for (int i = 0; i < config.max_workers; i++) {
+        struct slot *s = &scoreboard[i];
+        if (s->state == SLOT_EMPTY)
+            continue;
+        total++;
+        if (s->state == SLOT_IDLE && !s->retire) {
+            idle++;
+            last_idle = i;
+        }
+    }
+
+    if (total < config.workers) {
+        spawn_workers(socks, config.workers - total);
+    } else if (idle < config.min_spare && total < config.max_workers) {
+        int n = config.max_workers - total;
+        spawn_workers(socks, n < spawn_rate ? n : spawn_rate);
+        if (spawn_rate < MAX_SPAWN_RATE)
+            spawn_rate *= 2;
+        return;
+    } else if (idle > config.max_spare && total > config.workers) {
+        scoreboard[last_idle].retire = true;
+        kill(scoreboard[last_idle].pid, SIGTERM);
+    }
+    spawn_rate = 1;
+}
+
+static void dump_scoreboard(void)
+{
+    static const char *states[] = { "empty", "idle", "busy" };
+    unsigned long requests = retired_requests;
+    int total = 0, busy = 0;
+
+    fprintf(stderr, "slot      pid  state        conns     requests\n");
+    for (int i = 0; i < config.max_workers; i++) {
+        struct slot *s = &scoreboard[i];
+        if (s->state == SLOT_EMPTY)
+            continue;
+        fprintf(stderr, "%4d %8d  %-6s %10lu %12lu%s\n", i, s->pid, states[s->state],
+                s->conns, s->requests, s->retire ? "  retiring" : "");
+        total++;
+        busy += s->state == SLOT_BUSY;
+        requests += s->requests;
+    }
+    fprintf(stderr, "%d workers, %d busy, %lu requests served\n", total, busy, requests);
+}
+
+static void run_prefork(int *socks)
+{
+    supervisor = getpid();
+    scoreboard = mmap(NULL, config.max_workers * sizeof(*scoreboard), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (scoreboard == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    /* Without SA_RESTART both cut the maintenance sleep short */
+    sigaction(SIGCHLD, &(struct sigaction){ .sa_handler = handle_child }, NULL);
+    sigaction(SIGUSR1, &(struct sigaction){ .sa_handler = handle_dump }, NULL);
+
+    while (1) {
+        reap_workers(socks);
+        if (dump_requested) {
+            dump_requested = 0;
+            dump_scoreboard();
+        }
+        maintain_pool(socks);
+
+        struct timespec ts = { .tv_sec = MAINTENANCE_INTERVAL_MS / 1000,
+                               .tv_nsec = MAINTENANCE_INTERVAL_MS % 1000 * 1000000L };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void run_fork_per_connection(int sock)
+{
     signal(SIGCHLD, SIG_IGN);
 
     int client_sock;
@@ -182,10 +700,99 @@ int main(int argc, char *argv[])
             close(sock);
             handle_client(client_sock);
             close(client_sock);
-            return 0;
+            exit(0);
         }
         close(client_sock);
     }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-w workers] [-W max] [-s min_spare] [-S max_spare] [-r] [-n conns] [port]\n"
+                    "  -w  prefork this many long-lived workers that each accept and\n"
+                    "      serve one connection at a time, instead of forking a\n"
+                    "      process per connection (default 0)\n"
+                    "  -W  grow the pool up to this many workers to keep min_spare of\n"
+                    "      them idle, and shrink it back towards -w while more than\n"
+                    "      max_spare are idle (default -w, a fixed pool)\n"
+                    "  -s  min_spare (default %d)\n"
+                    "  -S  max_spare, above min_spare (default %d)\n"
+                    "  -r  give every worker its own SO_REUSEPORT listener rather than\n"
+                    "      sharing one\n"
+                    "  -n  replace a worker after it has served this many connections,\n"
+                    "      0 never (default)\n"
+                    "SIGUSR1 prints the prefork scoreboard to stderr.\n", prog,
+            DEFAULT_MIN_SPARE, DEFAULT_MAX_SPARE);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "w:W:s:S:rn:")) != -1) {
+        switch (opt) {
+        case 'w':
+            config.workers = atoi(optarg);
+            if (config.workers < 0)
+                usage(argv[0]);
+            break;
+        case 'W':
+            config.max_workers = atoi(optarg);
+            break;
+        case 's':
+            config.min_spare = atoi(optarg);
+            break;
+        case 'S':
+            config.max_spare = atoi(optarg);
+            break;
+        case 'r':
+            config.reuseport = true;
+            break;
+        case 'n':
+            config.max_conns = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind < argc)
+        config.port = atoi(argv[optind]);
+    if (config.max_workers < config.workers)
+        config.max_workers = config.workers;
+    if ((config.reuseport || config.max_conns || config.max_workers) && !config.workers)
+        usage(argv[0]);
+    /* Connections hashed to the listener of an empty slot would never be accepted */
+    if (config.reuseport && config.max_workers > config.workers)
+        usage(argv[0]);
+    if (config.min_spare < 0 || config.max_spare <= config.min_spare)
+        usage(argv[0]);
+
+    response_len = strlen(response);
+
+    int nr_socks = config.reuseport ? config.workers : 1;
+    int *socks = calloc(nr_socks, sizeof(*socks));
+    for (int i = 0; i < nr_socks; i++)
+        socks[i] = setup_listening_socket(config.port, config.reuseport);
+
+    printf("Listening on port %d\n", config.port);
+    if (config.workers) {
+        printf("Using %d prefork workers with %s", config.workers,
+               config.reuseport ? "SO_REUSEPORT listeners" : "a shared listener");
+        if (config.max_conns)
+            printf(", recycled every %d connections", config.max_conns);
+        printf("\n");
+        if (config.max_workers > config.workers) {
+            printf("Scaling up to %d workers, keeping %d to %d of them idle\n",
+                   config.max_workers, config.min_spare, config.max_spare);
+        }
+    }
+    fflush(stdout);
+
+    if (config.workers)
+        run_prefork(socks);
+    else
+        run_fork_per_connection(socks[0]);
 
     fprintf(stderr, "server exiting\n");
     return 0;
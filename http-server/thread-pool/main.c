@@ -0,0 +1,622 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include "picohttpparser.h"
+
+#define DEFAULT_SERVER_PORT     8000
+#define BUF_SZ                  8192
+
+/* Pipelined requests answered by a single writev */
+#define MAX_BATCH               16
+
+#define DEFAULT_THREADS         16
+#define DEFAULT_QUEUE_SIZE      1024
+#define DEFAULT_STACK_KB        64
+/*
+ * handle_client keeps its 8 KB request buffer on the stack, and glibc
+ * carves the thread's TLS out of the same allocation; 16 KB overflows.
+ */
+#define MIN_STACK_KB            24
+
+#define CACHE_LINE              64
+
+struct server_config {
+    int port;
+    int threads;
+    int queue_size;
+    int stack_kb;
+};
+
+static struct server_config config = {
+    .port = DEFAULT_SERVER_PORT,
+    .threads = DEFAULT_THREADS,
+    .queue_size = DEFAULT_QUEUE_SIZE,
+    .stack_kb = DEFAULT_STACK_KB,
+};
+
+/*
+ * Bounded MPMC queue of accepted sockets (Dmitry Vyukov's design). Every
+ * cell carries a sequence number that tells a producer whether the cell is
+ * free for its ticket and a consumer whether it has been filled, so the
+ * only shared writes are one CAS on the enqueue or dequeue position.
+ */
+struct cell {
+    size_t seq;
+    int fd;
+};
+
+struct mpmc_queue {
+    struct cell *cells;
+    size_t mask;
+    char pad0[CACHE_LINE];
+    size_t enqueue_pos;
+    char pad1[CACHE_LINE];
+    size_t dequeue_pos;
+    char pad2[CACHE_LINE];
+};
+
+/*
+ * The queue itself never blocks; these count filled and free cells so that
+ * idle workers sleep and the acceptor stops taking connections off the
+ * backlog while every cell is in use.
+ */
+static struct mpmc_queue queue;
+static sem_t queued, free_cells;
+
+static const char* response =
+            "HTTP/1.1 200 OK\r\n"
+            "Server: Assdi2024Server/1.0\r\n"
+            "Content-Type: text/html\r\n"
+            "Content-Length: 98\r\n"
+            "\r\n"
+            "<!DOCTYPE html><head><title>Hello, World!</title></head><body><h1>Hello, World!</h1></body></html>";
+static size_t response_len;
+
+static const char* bad_request =
+            "HTTP/1.1 400 Bad Request\r\n"
+            "Server: Assdi2024Server/1.0\r\n"
+            "Content-Type: text/html\r\n"
+            "Content-Length: 96\r\n"
+            "Connection: close\r\n"
+            "\r\n"
+            "<!DOCTYPE html><head><title>Bad Request!</title></head><body><h1>Bad Request!</h1></body></html>";
+
+static const char* continue_response = "HTTP/1.1 100 Continue\r\n\r\n";
+
+enum {
+    BODY_NONE,
+    BODY_LENGTH,
+    BODY_CHUNKED,
+};
+
+/* The body of the request being served */
+struct body {
+    int sock;
+    int kind;
+    unsigned long long left;    /* BODY_LENGTH: bytes not read yet */
+    struct phr_chunked_decoder decoder;
+};
+
+/*
+ * Endpoint that consumes a request body. start is called while the request
+ * headers are still valid, data with every window of decoded body in the
+ * receive buffer, and end once the body is complete. Each returns false if
+ * the connection has to be closed.
+ */
+struct body_handler {
+    bool (*start)(struct body *body, const struct phr_header *headers, size_t num_headers);
+    bool (*data)(struct body *body, const char *data, size_t len);
+    bool (*end)(struct body *body);
+};
+
+static bool should_close_connection(const struct phr_header *headers, size_t num_headers,
+                                    const struct phr_header_index *index)
+{
+    const struct phr_header *hdr = phr_find_header(headers, index, PHR_HEADER_CONNECTION);
+
+    if (!hdr)
+        return false;
+    if (!(index->repeated & (1u << PHR_HEADER_CONNECTION)))
+        return hdr->value_len == 5 && strncasecmp(hdr->value, "close", 5) == 0;
+
+    /* Repeated Connection headers are rare enough to scan for */
+    for (size_t i = hdr - headers; i < num_headers; i++) {
+        if (headers[i].name_len == 10 && strncasecmp(headers[i].name, "connection", 10) == 0) {
+            if (headers[i].value_len == 5 && strncasecmp(headers[i].value, "close", 5) == 0)
+                return true;
+        }
+    }
+    return false;
+}
+
+static void queue_init(struct mpmc_queue *q, size_t size)
+{
+    q->cells = calloc(size, sizeof(*q->cells));
+    q->mask = size - 1;
+    for (size_t i = 0; i < size; i++)
+        q->cells[i].seq = i;
+    q->enqueue_pos = 0;
+    q->dequeue_pos = 0;
+}
+
+static bool queue_push(struct mpmc_queue *q, int fd)
+{
+    size_t pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+
+    while (1) {
+        struct cell *cell = &q->cells[pos & q->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->fd = fd;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (diff < 0) {
+            /* Full, or the consumer of this cell has not finished reading it */
+            return false;
+        } else {
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static bool queue_pop(struct mpmc_queue *q, int *fd)
+{
+    size_t pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+
+    while (1) {
+        struct cell *cell = &q->cells[pos & q->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *fd = cell->fd;
+                __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (diff < 0) {
+            /* Empty, or the producer of this cell has not finished writing it */
+            return false;
+        } else {
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static bool expects_continue(const struct phr_header *headers, size_t num_headers)
+{
+    for (size_t i = 0; i < num_headers; i++) {
+        if (headers[i].name_len == 6 && strncasecmp(headers[i].name, "expect", 6) == 0)
+            return headers[i].value_len == 12 && strncasecmp(headers[i].value, "100-continue", 12) == 0;
+    }
+    return false;
+}
+
+/*
+ * Work out how the request body is framed. Conflicting or repeated framing
+ * headers, a transfer coding other than chunked and a malformed length are
+ * refused, as something in front of the server might frame the body
+ * differently. Returns BODY_NONE, BODY_LENGTH with *length set, BODY_CHUNKED
+ * or -1.
+ */
+static int body_framing(const struct phr_header *headers, const struct phr_header_index *index,
+                        unsigned long long *length)
+{
+    const struct phr_header *te = phr_find_header(headers, index, PHR_HEADER_TRANSFER_ENCODING);
+    const struct phr_header *cl = phr_find_header(headers, index, PHR_HEADER_CONTENT_LENGTH);
+
+    if (index->repeated & ((1u << PHR_HEADER_TRANSFER_ENCODING) | (1u << PHR_HEADER_CONTENT_LENGTH)))
+        return -1;
+    if (te && cl)
+        return -1;
+    if (te)
+        return te->value_len == 7 && strncasecmp(te->value, "chunked", 7) == 0 ? BODY_CHUNKED : -1;
+    if (!cl)
+        return BODY_NONE;
+
+    /* 18 digits cannot overflow */
+    if (cl->value_len == 0 || cl->value_len > 18)
+        return -1;
+    *length = 0;
+    for (size_t i = 0; i < cl->value_len; i++) {
+        if (!isdigit((unsigned char)cl->value[i]))
+            return -1;
+        *length = *length * 10 + (cl->value[i] - '0');
+    }
+    return *length ? BODY_LENGTH : BODY_NONE;
+}
+
+static int setup_listening_socket(int port)
+{
+    int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_sock < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+    /* Inherited by accepted sockets so batched responses are not held back by Nagle */
+    setsockopt(listen_sock, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+    struct sockaddr_in server_addr;
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (bind(listen_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+
+    if (listen(listen_sock, 128) < 0) {
+        perror("listen");
+        exit(1);
+    }
+
+    return listen_sock;
+}
+
+/* Returns false if the connection broke */
+static bool send_responses(int sock, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t sret = writev(sock, iov, iovcnt);
+        if (sret < 0)
+            return false;
+
+        while (iovcnt > 0 && (size_t)sret >= iov->iov_len) {
+            sret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + sret;
+            iov->iov_len -= sret;
+        }
+    }
+    return true;
+}
+
+/*
+ * POST /echo: send the body straight back, framed the way it came in, one
+ * chunk per window when it came chunked.
+ */
+static bool echo_start(struct body *body, const struct phr_header *headers, size_t num_headers)
+{
+    char head[256];
+    int len = 0;
+
+    if (expects_continue(headers, num_headers))
+        len = snprintf(head, sizeof(head), "%s", continue_response);
+    len += snprintf(head + len, sizeof(head) - len,
+                    "HTTP/1.1 200 OK\r\n"
+                    "Server: Assdi2024Server/1.0\r\n"
+                    "Content-Type: application/octet-stream\r\n");
+    if (body->kind == BODY_CHUNKED)
+        len += snprintf(head + len, sizeof(head) - len, "Transfer-Encoding: chunked\r\n\r\n");
+    else
+        len += snprintf(head + len, sizeof(head) - len, "Content-Length: %llu\r\n\r\n", body->left);
+
+    struct iovec iov = { .iov_base = head, .iov_len = len };
+    return send_responses(body->sock, &iov, 1);
+}
+
+static bool echo_data(struct body *body, const char *data, size_t len)
+{
+    char size[32];
+    struct iovec iov[3];
+    int iovcnt = 0;
+
+    if (body->kind == BODY_CHUNKED)
+        iov[iovcnt++] = (struct iovec){ .iov_base = size, .iov_len = snprintf(size, sizeof(size), "%zx\r\n", len) };
+    iov[iovcnt++] = (struct iovec){ .iov_base = (void *)data, .iov_len = len };
+    if (body->kind == BODY_CHUNKED)
+        iov[iovcnt++] = (struct iovec){ .iov_base = "\r\n", .iov_len = 2 };
+    return send_responses(body->sock, iov, iovcnt);
+}
+
+static bool echo_end(struct body *body)
+{
+    if (body->kind != BODY_CHUNKED)
+        return true;
+
+    struct iovec iov = { .iov_base = "0\r\n\r\n", .iov_len = 5 };
+    return send_responses(body->sock, &iov, 1);
+}
+
+static const struct body_handler echo_handler = { echo_start, echo_data, echo_end };
+
+static const struct body_handler *find_body_handler(const char *method, size_t method_len,
+                                                    const char *path, size_t path_len)
+{
+    if (method_len == 4 && memcmp(method, "POST", 4) == 0 && path_len == 5 && memcmp(path, "/echo", 5) == 0)
+        return &echo_handler;
+    return NULL;
+}
+
+/*
+ * Feed the body at the start of buf to the handler a window at a time,
+ * receiving the next window into buf once the handler is done with the
+ * last, so a body of any size passes through BUF_SZ bytes. Afterwards buf
+ * holds whatever followed the body. Returns false if the connection has
+ * to be closed.
+ */
+static bool stream_body(struct body *body, const struct body_handler *handler, char *buf, size_t *buflen)
+{
+    size_t len = *buflen, n;
+    ssize_t rest;
+
+    while (1) {
+        if (body->kind == BODY_LENGTH) {
+            n = len < body->left ? len : body->left;
+            body->left -= n;
+            rest = len - n;
+        } else {
+            n = len;
+            rest = phr_decode_chunked(&body->decoder, buf, &n);
+            if (rest == -1)
+                return false;
+        }
+
+        if (n > 0 && !handler->data(body, buf, n))
+            return false;
+        if (body->kind == BODY_LENGTH ? body->left == 0 : rest >= 0)
+            break;
+
+        ssize_t rret = recv(body->sock, buf, BUF_SZ, 0);
+        if (rret <= 0)
+            return false;
+        len = rret;
+    }
+
+    memmove(buf, buf + n, rest);
+    *buflen = rest;
+    return handler->end(body);
+}
+
+
+/*
+ * Same as the multi-process server: answer every complete request in the
+ * buffer after each read, with one writev per batch of pipelined requests,
+ * and stream request bodies to their endpoint.
+ */
+static void handle_client(int sock)
+{
+    char buf[BUF_SZ];
+    size_t buflen = 0, prevbuflen;
+    struct iovec iov[MAX_BATCH];
+    struct body body = { .sock = sock };
+
+    while (1) {
+        /* Receive Request */
+        ssize_t rret = recv(sock, buf + buflen, BUF_SZ - buflen, 0);
+
+        if (rret < 0 || (rret == 0 && buflen == 0))
+            break;
+
+        prevbuflen = buflen;
+        buflen += rret;
+
+        size_t consumed = 0;
+        int iovcnt = 0, pret;
+        bool cont = true;
+
+        while (cont) {
+            struct phr_header headers[50];
+            struct phr_header_index index;
+            const char *method, *path;
+            size_t method_len, path_len, num_headers = 50;
+            int minor_version;
+
+            pret = phr_parse_request_indexed(buf + consumed, buflen - consumed, &method, &method_len,
+                                             &path, &path_len, &minor_version, headers, &num_headers,
+                                             prevbuflen, &index);
+            if (pret < 0)
+                break;
+
+            cont = minor_version == 1 && !should_close_connection(headers, num_headers, &index);
+
+            const struct body_handler *handler = find_body_handler(method, method_len, path, path_len);
+            body.left = 0;
+            body.kind = body_framing(headers, &index, &body.left);
+            if ((!handler && (method_len != 3 || memcmp(method, "GET", 3) != 0)) ||
+                body.kind < 0 || (body.kind != BODY_NONE && !handler)) {
+                pret = -1;
+                break;
+            }
+
+            /* Request is complete */
+            consumed += pret;
+            prevbuflen = 0;
+
+            if (handler) {
+                if (!send_responses(sock, iov, iovcnt))
+                    return;
+                iovcnt = 0;
+                if (body.kind == BODY_NONE)
+                    body.kind = BODY_LENGTH;
+                memset(&body.decoder, 0, sizeof(body.decoder));
+                body.decoder.consume_trailer = 1;
+                if (!handler->start(&body, headers, num_headers))
+                    return;
+
+                memmove(buf, buf + consumed, buflen - consumed);
+                buflen -= consumed;
+                consumed = 0;
+                if (!stream_body(&body, handler, buf, &buflen))
+                    return;
+                continue;
+            }
+
+            iov[iovcnt++] = (struct iovec){ .iov_base = (void *)response, .iov_len = response_len };
+
+            if (iovcnt == MAX_BATCH) {
+                if (!send_responses(sock, iov, iovcnt))
+                    return;
+                iovcnt = 0;
+            }
+        }
+
+        /* request is too long */
+        if (pret == -2 && buflen - consumed == BUF_SZ)
+            pret = -1;
+
+        if (pret == -1) {
+            /* parse error */
+            iov[iovcnt++] = (struct iovec){ .iov_base = (void *)bad_request, .iov_len = strlen(bad_request) };
+            cont = false;
+        }
+
+        if (!send_responses(sock, iov, iovcnt))
+            return;
+
+        if (!cont)
+            break;
+        if (rret == 0) /* EOF */
+            break;
+
+        memmove(buf, buf + consumed, buflen - consumed);
+        buflen -= consumed;
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    (void)arg;
+
+    while (1) {
+        int fd;
+
+        while (sem_wait(&queued) < 0)
+            ;
+        /* A cell counted by the semaphore can still be mid-write by its producer */
+        while (!queue_pop(&queue, &fd))
+            sched_yield();
+        sem_post(&free_cells);
+
+        handle_client(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static void start_workers(void)
+{
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    if (pthread_attr_setstacksize(&attr, (size_t)config.stack_kb * 1024) != 0) {
+        fprintf(stderr, "invalid stack size %d KB\n", config.stack_kb);
+        exit(1);
+    }
+
+    for (int i = 0; i < config.threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, worker_thread, NULL) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-t threads] [-q queue_size] [-s stack_kb] [port]\n"
+                    "  -t  number of blocking worker threads, each serving one\n"
+                    "      connection at a time (default %d)\n"
+                    "  -q  accepted connections waiting for a worker, a power of two\n"
+                    "      (default %d)\n"
+                    "  -s  worker thread stack size in KB, at least %d (default %d)\n", prog,
+            DEFAULT_THREADS, DEFAULT_QUEUE_SIZE, MIN_STACK_KB, DEFAULT_STACK_KB);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "t:q:s:")) != -1) {
+        switch (opt) {
+        case 't':
+            config.threads = atoi(optarg);
+            if (config.threads < 1)
+                usage(argv[0]);
+            break;
+        case 'q':
+            config.queue_size = atoi(optarg);
+            if (config.queue_size < 2 || (config.queue_size & (config.queue_size - 1)))
+                usage(argv[0]);
+            break;
+        case 's':
+            config.stack_kb = atoi(optarg);
+            if (config.stack_kb < MIN_STACK_KB)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind < argc)
+        config.port = atoi(argv[optind]);
+
+    response_len = strlen(response);
+    /* A peer resetting mid-writev must fail the call, not kill the process */
+    signal(SIGPIPE, SIG_IGN);
+
+    queue_init(&queue, config.queue_size);
+    sem_init(&queued, 0, 0);
+    sem_init(&free_cells, 0, config.queue_size);
+
+    int sock = setup_listening_socket(config.port);
+    printf("Listening on port %d\n", config.port);
+    printf("Using %d worker threads with %d KB stacks, queue of %d\n",
+           config.threads, config.stack_kb, config.queue_size);
+    fflush(stdout);
+
+    start_workers();
+
+    /* The main thread is the only producer */
+    while (1) {
+        while (sem_wait(&free_cells) < 0)
+            ;
+
+        int client_sock;
+        while ((client_sock = accept(sock, NULL, NULL)) < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("accept");
+                sleep(1);
+            }
+        }
+
+        /*
+         * A cell counted by the semaphore can still be mid-read by its
+         * consumer: another consumer may pop a later cell and post first
+         */
+        while (!queue_push(&queue, client_sock))
+            sched_yield();
+        sem_post(&queued);
+    }
+
+    fprintf(stderr, "server exiting\n");
+    return 0;
+}
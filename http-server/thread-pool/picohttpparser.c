@@ -0,0 +1,989 @@
+/*
+ * Copyright (c) 2009-2014 Kazuho Oku, Tokuhiro Matsuno, Daisuke Murase,
+ *                         Shigeo Mitsunari
+ *
+ * The software is licensed under either the MIT License (below) or the Perl
+ * license.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/* pick the widest scanning kernel the CPU supports at startup, see findchar_fast */
+#define PHR_SIMD_DISPATCH 1
+#include <stdlib.h>
+#include <x86intrin.h>
+#elif defined(__SSE4_2__)
+#ifdef _MSC_VER
+#include <nmmintrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+#include "picohttpparser.h"
+
+#if __GNUC__ >= 3
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#else
+#define likely(x) (x)
+#define unlikely(x) (x)
+#endif
+
+#ifdef _MSC_VER
+#define ALIGNED(n) _declspec(align(n))
+#else
+#define ALIGNED(n) __attribute__((aligned(n)))
+#endif
+
+#define IS_PRINTABLE_ASCII(c) ((unsigned char)(c)-040u < 0137u)
+
+#define CHECK_EOF()                                                                                                                \
+    if (buf == buf_end) {                                                                                                          \
+        *ret = -2;                                                                                                                 \
+        return NULL;                                                                                                               \
+    }
+
+#define EXPECT_CHAR_NO_CHECK(ch)                                                                                                   \
+    if (*buf++ != ch) {                                                                                                            \
+        *ret = -1;                                                                                                                 \
+        return NULL;                                                                                                               \
+    }
+
+#define EXPECT_CHAR(ch)                                                                                                            \
+    CHECK_EOF();                                                                                                                   \
+    EXPECT_CHAR_NO_CHECK(ch);
+
+#define ADVANCE_TOKEN(tok, toklen)                                                                                                 \
+    do {                                                                                                                           \
+        const char *tok_start = buf;                                                                                               \
+        int found2;                                                                                                                \
+        buf = findchar_fast(buf, buf_end, &path_delims, &found2);                                                                  \
+        if (!found2) {                                                                                                             \
+            CHECK_EOF();                                                                                                           \
+        }                                                                                                                          \
+        while (1) {                                                                                                                \
+            if (*buf == ' ') {                                                                                                     \
+                break;                                                                                                             \
+            } else if (unlikely(!IS_PRINTABLE_ASCII(*buf))) {                                                                      \
+                if ((unsigned char)*buf < '\040' || *buf == '\177') {                                                              \
+                    *ret = -1;                                                                                                     \
+                    return NULL;                                                                                                   \
+                }                                                                                                                  \
+            }                                                                                                                      \
+            ++buf;                                                                                                                 \
+            CHECK_EOF();                                                                                                           \
+        }                                                                                                                          \
+        tok = tok_start;                                                                                                           \
+        toklen = buf - tok_start;                                                                                                  \
+    } while (0)
+
+static const char *token_char_map = "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+                                    "\0\1\0\1\1\1\1\1\0\0\1\1\0\1\1\0\1\1\1\1\1\1\1\1\1\1\0\0\0\0\0\0"
+                                    "\0\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\0\0\0\1\1"
+                                    "\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\0\1\0\1\0"
+                                    "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+                                    "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+                                    "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+                                    "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
+
+/*
+ * A set of bytes a scan stops at, as up to eight (lo, hi) pairs for pcmpestri. The AVX2 and AVX-512 kernels classify bytes with
+ * two table lookups instead, one on each nibble; those tables are built from the same set at startup.
+ */
+struct char_class {
+    ALIGNED(16) char ranges[16];
+    int ranges_size;
+#if PHR_SIMD_DISPATCH
+    ALIGNED(16) unsigned char lo_nibble[16];
+    ALIGNED(16) unsigned char hi_nibble[16];
+#endif
+};
+
+/* the request target ends at SP, a control char or DEL */
+static struct char_class path_delims = {.ranges = "\000\040\177\177", .ranges_size = 4};
+
+static struct char_class value_delims = {.ranges = "\0\010"    /* allow HT */
+                                                   "\012\037"  /* allow SP and up to but not including DEL */
+                                                   "\177\177", /* allow chars w. MSB set */
+                                         .ranges_size = 6};
+
+/* is_complete only has to look at line endings */
+static struct char_class eol_chars = {.ranges = "\n\n\r\r", .ranges_size = 4};
+
+/* We use pcmpestri to detect non-token characters. This instruction can take no more than eight character ranges (8*2*8=128
+ * bits that is the size of a SSE register). Due to this restriction, characters `|` and `~` are handled in the slow loop. The
+ * nibble tables have no such limit and are built from token_char_map itself. */
+static struct char_class token_delims = {.ranges = "\x00 "  /* control chars and up to SP */
+                                                   "\"\""   /* 0x22 */
+                                                   "()"     /* 0x28,0x29 */
+                                                   ",,"     /* 0x2c */
+                                                   "//"     /* 0x2f */
+                                                   ":@"     /* 0x3a-0x40 */
+                                                   "[]"     /* 0x5b-0x5d */
+                                                   "{\xff", /* 0x7b-0xff */
+                                         .ranges_size = 16};
+
+#if PHR_SIMD_DISPATCH
+
+/*
+ * findchar_fast skips ahead to the first byte of the class, or stops early before the last few bytes and leaves them to the
+ * caller's byte loop, clearing `found`. Each kernel below does this with a different vector width; which one runs is decided
+ * once at startup from cpuid, so a single binary uses AVX2 where the CPU has it and still runs on one that does not. Setting
+ * PICOHTTPPARSER_SIMD to "generic", "sse4.2", "avx2" or "avx512bw" picks a kernel instead, falling back to a narrower one the
+ * CPU supports, for benchmarking the kernels against each other.
+ */
+typedef const char *(*findchar_fn)(const char *buf, const char *buf_end, const struct char_class *cc, int *found);
+
+/* the smallest page size on x86, a load that stays within one page of a valid byte cannot fault */
+#define MIN_PAGE_SIZE 4096
+
+static const char *findchar_generic(const char *buf, const char *buf_end, const struct char_class *cc, int *found)
+{
+    *found = 0;
+    (void)buf_end;
+    (void)cc;
+    return buf;
+}
+
+__attribute__((target("sse4.2"))) static const char *findchar_sse42(const char *buf, const char *buf_end,
+                                                                    const struct char_class *cc, int *found)
+{
+    *found = 0;
+    if (likely(buf_end - buf >= 16)) {
+        __m128i ranges16 = _mm_load_si128((const __m128i *)cc->ranges);
+
+        size_t left = (buf_end - buf) & ~15;
+        do {
+            __m128i b16 = _mm_loadu_si128((const __m128i *)buf);
+            int r = _mm_cmpestri(ranges16, cc->ranges_size, b16, 16, _SIDD_LEAST_SIGNIFICANT | _SIDD_CMP_RANGES | _SIDD_UBYTE_OPS);
+            if (unlikely(r != 16)) {
+                buf += r;
+                *found = 1;
+                break;
+            }
+            buf += 16;
+            left -= 16;
+        } while (likely(left != 0));
+    }
+    return buf;
+}
+
+/* Byte b is in the class when lo_nibble[b & 15] and hi_nibble[b >> 4] share a bit; returns one bit per byte */
+__attribute__((target("avx2"))) static inline unsigned class_mask_avx2(__m256i b, __m256i lo_nibble, __m256i hi_nibble)
+{
+    __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_shuffle_epi8(lo_nibble, _mm256_and_si256(b, nibble));
+    __m256i hi = _mm256_shuffle_epi8(hi_nibble, _mm256_and_si256(_mm256_srli_epi16(b, 4), nibble));
+    __m256i miss = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+    return ~(unsigned)_mm256_movemask_epi8(miss);
+}
+
+/* The tail load may read past buf_end, though never past its page, which the address sanitizer cannot tell apart from a bug */
+__attribute__((target("avx2"), no_sanitize_address)) static const char *findchar_avx2(const char *buf, const char *buf_end,
+                                                                                      const struct char_class *cc, int *found)
+{
+    __m256i lo_nibble = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)cc->lo_nibble));
+    __m256i hi_nibble = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)cc->hi_nibble));
+    unsigned mask;
+
+    *found = 0;
+    while (buf_end - buf >= 32) {
+        mask = class_mask_avx2(_mm256_loadu_si256((const __m256i *)buf), lo_nibble, hi_nibble);
+        if (unlikely(mask != 0))
+            goto Found;
+        buf += 32;
+    }
+    /* most tokens are shorter than a vector; scan them with one load unless that would cross into the next page */
+    if (buf != buf_end && ((uintptr_t)buf & (MIN_PAGE_SIZE - 1)) <= MIN_PAGE_SIZE - 32) {
+        mask = class_mask_avx2(_mm256_loadu_si256((const __m256i *)buf), lo_nibble, hi_nibble);
+        mask &= (1u << (buf_end - buf)) - 1;
+        if (mask != 0)
+            goto Found;
+        buf = buf_end;
+    }
+    return buf;
+
+Found:
+    *found = 1;
+    return buf + __builtin_ctz(mask);
+}
+
+/*
+ * Masked loads let the tail be scanned without reading past buf_end. Most header names and values are shorter than one
+ * 64-byte vector though, and on full requests this kernel measures slower than the AVX2 one, so it only runs when asked for.
+ */
+__attribute__((target("avx512f,avx512bw,bmi2"))) static const char *findchar_avx512(const char *buf, const char *buf_end,
+                                                                                     const struct char_class *cc, int *found)
+{
+    __m512i lo_nibble = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)cc->lo_nibble));
+    __m512i hi_nibble = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)cc->hi_nibble));
+    __m512i nibble = _mm512_set1_epi8(0x0f);
+
+    *found = 0;
+    while (buf != buf_end) {
+        size_t left = buf_end - buf;
+        __mmask64 live = _bzhi_u64(~(__mmask64)0, left >= 64 ? 64 : left);
+        __m512i b = _mm512_maskz_loadu_epi8(live, buf);
+        __m512i lo = _mm512_shuffle_epi8(lo_nibble, _mm512_and_si512(b, nibble));
+        __m512i hi = _mm512_shuffle_epi8(hi_nibble, _mm512_and_si512(_mm512_srli_epi16(b, 4), nibble));
+        __mmask64 hit = _mm512_test_epi8_mask(lo, hi) & live;
+        if (unlikely(hit != 0)) {
+            *found = 1;
+            return buf + __builtin_ctzll(hit);
+        }
+        buf += left >= 64 ? 64 : left;
+    }
+    return buf;
+}
+
+/*
+ * Give every high nibble whose row of the class is non-empty one of eight bits, shared between rows that are equal, and set
+ * that bit in lo_nibble for each low nibble in the row.
+ */
+static void init_nibble_tables(struct char_class *cc, const char *in_class)
+{
+    int nbits = 0;
+
+    memset(cc->lo_nibble, 0, sizeof(cc->lo_nibble));
+    memset(cc->hi_nibble, 0, sizeof(cc->hi_nibble));
+    for (int hi = 0; hi != 16; ++hi) {
+        for (int prev = 0; prev != hi && !cc->hi_nibble[hi]; ++prev) {
+            if (cc->hi_nibble[prev] && memcmp(in_class + prev * 16, in_class + hi * 16, 16) == 0)
+                cc->hi_nibble[hi] = cc->hi_nibble[prev];
+        }
+        if (cc->hi_nibble[hi] || memchr(in_class + hi * 16, 1, 16) == NULL)
+            continue;
+        assert(nbits < 8);
+        cc->hi_nibble[hi] = 1 << nbits++;
+        for (int lo = 0; lo != 16; ++lo) {
+            if (in_class[hi * 16 + lo])
+                cc->lo_nibble[lo] |= cc->hi_nibble[hi];
+        }
+    }
+}
+
+static void init_ranges_class(struct char_class *cc)
+{
+    char in_class[256] = {0};
+
+    for (int i = 0; i < cc->ranges_size; i += 2) {
+        for (int c = (unsigned char)cc->ranges[i]; c <= (unsigned char)cc->ranges[i + 1]; ++c)
+            in_class[c] = 1;
+    }
+    init_nibble_tables(cc, in_class);
+}
+
+static findchar_fn findchar_fast = findchar_generic;
+
+__attribute__((constructor)) static void select_findchar(void)
+{
+    const char *wanted = getenv("PICOHTTPPARSER_SIMD");
+    char non_token[256];
+
+    if (wanted != NULL && *wanted == '\0')
+        wanted = NULL;
+    int allowed = wanted == NULL;
+
+    init_ranges_class(&path_delims);
+    init_ranges_class(&value_delims);
+    init_ranges_class(&eol_chars);
+    for (int c = 0; c != 256; ++c)
+        non_token[c] = !token_char_map[c];
+    init_nibble_tables(&token_delims, non_token);
+
+    __builtin_cpu_init();
+    const struct {
+        const char *name;
+        int supported;
+        int by_default;
+        findchar_fn fn;
+    } kernels[] = {
+        {"avx512bw", __builtin_cpu_supports("avx512bw"), 0, findchar_avx512},
+        {"avx2", __builtin_cpu_supports("avx2"), 1, findchar_avx2},
+        {"sse4.2", __builtin_cpu_supports("sse4.2"), 1, findchar_sse42},
+    };
+
+    /* take the widest supported kernel, starting from the one asked for */
+    for (size_t i = 0; i != sizeof(kernels) / sizeof(kernels[0]); ++i) {
+        if (!allowed && strcmp(wanted, kernels[i].name) == 0)
+            allowed = 1;
+        if (allowed && kernels[i].supported && (wanted != NULL || kernels[i].by_default)) {
+            findchar_fast = kernels[i].fn;
+            return;
+        }
+    }
+}
+
+#else
+
+static const char *findchar_fast(const char *buf, const char *buf_end, const struct char_class *cc, int *found)
+{
+    *found = 0;
+#if __SSE4_2__
+    if (likely(buf_end - buf >= 16)) {
+        __m128i ranges16 = _mm_load_si128((const __m128i *)cc->ranges);
+
+        size_t left = (buf_end - buf) & ~15;
+        do {
+            __m128i b16 = _mm_loadu_si128((const __m128i *)buf);
+            int r = _mm_cmpestri(ranges16, cc->ranges_size, b16, 16, _SIDD_LEAST_SIGNIFICANT | _SIDD_CMP_RANGES | _SIDD_UBYTE_OPS);
+            if (unlikely(r != 16)) {
+                buf += r;
+                *found = 1;
+                break;
+            }
+            buf += 16;
+            left -= 16;
+        } while (likely(left != 0));
+    }
+#else
+    /* suppress unused parameter warning */
+    (void)buf_end;
+    (void)cc;
+#endif
+    return buf;
+}
+
+#endif
+
+static const char *get_token_to_eol(const char *buf, const char *buf_end, const char **token, size_t *token_len, int *ret)
+{
+    const char *token_start = buf;
+
+    int found;
+    buf = findchar_fast(buf, buf_end, &value_delims, &found);
+    if (found)
+        goto FOUND_CTL;
+    /* find non-printable char within the next 8 bytes, this is the hottest code; manually inlined */
+    while (likely(buf_end - buf >= 8)) {
+#define DOIT()                                                                                                                     \
+    do {                                                                                                                           \
+        if (unlikely(!IS_PRINTABLE_ASCII(*buf)))                                                                                   \
+            goto NonPrintable;                                                                                                     \
+        ++buf;                                                                                                                     \
+    } while (0)
+        DOIT();
+        DOIT();
+        DOIT();
+        DOIT();
+        DOIT();
+        DOIT();
+        DOIT();
+        DOIT();
+#undef DOIT
+        continue;
+    NonPrintable:
+        if ((likely((unsigned char)*buf < '\040') && likely(*buf != '\011')) || unlikely(*buf == '\177')) {
+            goto FOUND_CTL;
+        }
+        ++buf;
+    }
+    for (;; ++buf) {
+        CHECK_EOF();
+        if (unlikely(!IS_PRINTABLE_ASCII(*buf))) {
+            if ((likely((unsigned char)*buf < '\040') && likely(*buf != '\011')) || unlikely(*buf == '\177')) {
+                goto FOUND_CTL;
+            }
+        }
+    }
+FOUND_CTL:
+    if (likely(*buf == '\015')) {
+        ++buf;
+        EXPECT_CHAR('\012');
+        *token_len = buf - 2 - token_start;
+    } else if (*buf == '\012') {
+        *token_len = buf - token_start;
+        ++buf;
+    } else {
+        *ret = -1;
+        return NULL;
+    }
+    *token = token_start;
+
+    return buf;
+}
+
+static const char *is_complete(const char *buf, const char *buf_end, size_t last_len, int *ret)
+{
+    int ret_cnt = 0;
+    buf = last_len < 3 ? buf : buf + last_len - 3;
+
+    while (1) {
+        /* bytes up to the next CR or LF only reset the count */
+        if (ret_cnt == 0) {
+            int found;
+            buf = findchar_fast(buf, buf_end, &eol_chars, &found);
+            if (!found) {
+                while (buf != buf_end && *buf != '\015' && *buf != '\012')
+                    ++buf;
+            }
+        }
+        CHECK_EOF();
+        if (*buf == '\015') {
+            ++buf;
+            CHECK_EOF();
+            EXPECT_CHAR('\012');
+            ++ret_cnt;
+        } else if (*buf == '\012') {
+            ++buf;
+            ++ret_cnt;
+        } else {
+            ++buf;
+            ret_cnt = 0;
+        }
+        if (ret_cnt == 2) {
+            return buf;
+        }
+    }
+
+    *ret = -2;
+    return NULL;
+}
+
+#define PARSE_INT(valp_, mul_)                                                                                                     \
+    if (*buf < '0' || '9' < *buf) {                                                                                                \
+        buf++;                                                                                                                     \
+        *ret = -1;                                                                                                                 \
+        return NULL;                                                                                                               \
+    }                                                                                                                              \
+    *(valp_) = (mul_) * (*buf++ - '0');
+
+#define PARSE_INT_3(valp_)                                                                                                         \
+    do {                                                                                                                           \
+        int res_ = 0;                                                                                                              \
+        PARSE_INT(&res_, 100)                                                                                                      \
+        *valp_ = res_;                                                                                                             \
+        PARSE_INT(&res_, 10)                                                                                                       \
+        *valp_ += res_;                                                                                                            \
+        PARSE_INT(&res_, 1)                                                                                                        \
+        *valp_ += res_;                                                                                                            \
+    } while (0)
+
+/* returned pointer is always within [buf, buf_end), or null */
+static const char *parse_token(const char *buf, const char *buf_end, const char **token, size_t *token_len, char next_char,
+                               int *ret)
+{
+    const char *buf_start = buf;
+    int found;
+    buf = findchar_fast(buf, buf_end, &token_delims, &found);
+    if (!found) {
+        CHECK_EOF();
+    }
+    while (1) {
+        if (*buf == next_char) {
+            break;
+        } else if (!token_char_map[(unsigned char)*buf]) {
+            *ret = -1;
+            return NULL;
+        }
+        ++buf;
+        CHECK_EOF();
+    }
+    *token = buf_start;
+    *token_len = buf - buf_start;
+    return buf;
+}
+
+/* returned pointer is always within [buf, buf_end), or null */
+static const char *parse_http_version(const char *buf, const char *buf_end, int *minor_version, int *ret)
+{
+    /* we want at least [HTTP/1.<two chars>] to try to parse */
+    if (buf_end - buf < 9) {
+        *ret = -2;
+        return NULL;
+    }
+    EXPECT_CHAR_NO_CHECK('H');
+    EXPECT_CHAR_NO_CHECK('T');
+    EXPECT_CHAR_NO_CHECK('T');
+    EXPECT_CHAR_NO_CHECK('P');
+    EXPECT_CHAR_NO_CHECK('/');
+    EXPECT_CHAR_NO_CHECK('1');
+    EXPECT_CHAR_NO_CHECK('.');
+    PARSE_INT(minor_version, 1);
+    return buf;
+}
+
+#define FOLD_CASE_32 0x20202020u
+#define FOLD_CASE_64 0x2020202020202020ull
+
+static inline uint32_t load_u32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t load_u64(const char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Compares a header name of len bytes, 4 <= len <= 24, with a lower-case literal a word at a time. Names are tokens, and the only
+ * token chars that setting bit 0x20 turns into a given letter or '-' are its upper-case form and the char itself. */
+static inline int name_equals(const char *name, const char *lower, size_t len)
+{
+    if (len < 8)
+        return (((load_u32(name) | FOLD_CASE_32) ^ load_u32(lower)) |
+                ((load_u32(name + len - 4) | FOLD_CASE_32) ^ load_u32(lower + len - 4))) == 0;
+
+    uint64_t diff = (load_u64(name + len - 8) | FOLD_CASE_64) ^ load_u64(lower + len - 8);
+    for (size_t off = 0; off + 8 < len; off += 8)
+        diff |= (load_u64(name + off) | FOLD_CASE_64) ^ load_u64(lower + off);
+    return diff == 0;
+}
+
+/* The well-known names all differ in length, so the length picks the one candidate to compare with */
+static void index_header(struct phr_header_index *index, const struct phr_header *header, int pos)
+{
+    int id;
+
+#define KNOWN_HEADER(len, lower, hdr_id)                                                                                           \
+    case len:                                                                                                                      \
+        if (!name_equals(header->name, lower, len))                                                                               \
+            return;                                                                                                                \
+        id = hdr_id;                                                                                                               \
+        break;
+    switch (header->name_len) {
+        KNOWN_HEADER(4, "host", PHR_HEADER_HOST)
+        KNOWN_HEADER(10, "connection", PHR_HEADER_CONNECTION)
+        KNOWN_HEADER(13, "if-none-match", PHR_HEADER_IF_NONE_MATCH)
+        KNOWN_HEADER(14, "content-length", PHR_HEADER_CONTENT_LENGTH)
+        KNOWN_HEADER(15, "accept-encoding", PHR_HEADER_ACCEPT_ENCODING)
+        KNOWN_HEADER(17, "transfer-encoding", PHR_HEADER_TRANSFER_ENCODING)
+    default:
+        return;
+    }
+#undef KNOWN_HEADER
+
+    if (index->first[id] < 0)
+        index->first[id] = pos;
+    else
+        index->repeated |= 1u << id;
+}
+
+static const char *parse_headers(const char *buf, const char *buf_end, struct phr_header *headers, size_t *num_headers,
+                                 size_t max_headers, struct phr_header_index *index, int *ret)
+{
+    for (;; ++*num_headers) {
+        CHECK_EOF();
+        if (*buf == '\015') {
+            ++buf;
+            EXPECT_CHAR('\012');
+            break;
+        } else if (*buf == '\012') {
+            ++buf;
+            break;
+        }
+        if (*num_headers == max_headers) {
+            *ret = -1;
+            return NULL;
+        }
+        if (!(*num_headers != 0 && (*buf == ' ' || *buf == '\t'))) {
+            /* parsing name, but do not discard SP before colon, see
+             * http://www.mozilla.org/security/announce/2006/mfsa2006-33.html */
+            if ((buf = parse_token(buf, buf_end, &headers[*num_headers].name, &headers[*num_headers].name_len, ':', ret)) == NULL) {
+                return NULL;
+            }
+            if (headers[*num_headers].name_len == 0) {
+                *ret = -1;
+                return NULL;
+            }
+            if (index != NULL)
+                index_header(index, &headers[*num_headers], (int)*num_headers);
+            ++buf;
+            for (;; ++buf) {
+                CHECK_EOF();
+                if (!(*buf == ' ' || *buf == '\t')) {
+                    break;
+                }
+            }
+        } else {
+            headers[*num_headers].name = NULL;
+            headers[*num_headers].name_len = 0;
+        }
+        const char *value;
+        size_t value_len;
+        if ((buf = get_token_to_eol(buf, buf_end, &value, &value_len, ret)) == NULL) {
+            return NULL;
+        }
+        /* remove trailing SPs and HTABs */
+        const char *value_end = value + value_len;
+        for (; value_end != value; --value_end) {
+            const char c = *(value_end - 1);
+            if (!(c == ' ' || c == '\t')) {
+                break;
+            }
+        }
+        headers[*num_headers].value = value;
+        headers[*num_headers].value_len = value_end - value;
+    }
+    return buf;
+}
+
+static const char *parse_request(const char *buf, const char *buf_end, const char **method, size_t *method_len, const char **path,
+                                 size_t *path_len, int *minor_version, struct phr_header *headers, size_t *num_headers,
+                                 size_t max_headers, struct phr_header_index *index, int *ret)
+{
+    /* skip first empty line (some clients add CRLF after POST content) */
+    CHECK_EOF();
+    if (*buf == '\015') {
+        ++buf;
+        EXPECT_CHAR('\012');
+    } else if (*buf == '\012') {
+        ++buf;
+    }
+
+    /* parse request line */
+    if ((buf = parse_token(buf, buf_end, method, method_len, ' ', ret)) == NULL) {
+        return NULL;
+    }
+    do {
+        ++buf;
+        CHECK_EOF();
+    } while (*buf == ' ');
+    ADVANCE_TOKEN(*path, *path_len);
+    do {
+        ++buf;
+        CHECK_EOF();
+    } while (*buf == ' ');
+    if (*method_len == 0 || *path_len == 0) {
+        *ret = -1;
+        return NULL;
+    }
+    if ((buf = parse_http_version(buf, buf_end, minor_version, ret)) == NULL) {
+        return NULL;
+    }
+    if (*buf == '\015') {
+        ++buf;
+        EXPECT_CHAR('\012');
+    } else if (*buf == '\012') {
+        ++buf;
+    } else {
+        *ret = -1;
+        return NULL;
+    }
+
+    return parse_headers(buf, buf_end, headers, num_headers, max_headers, index, ret);
+}
+
+int phr_parse_request_indexed(const char *buf_start, size_t len, const char **method, size_t *method_len, const char **path,
+                              size_t *path_len, int *minor_version, struct phr_header *headers, size_t *num_headers, size_t last_len,
+                              struct phr_header_index *index)
+{
+    const char *buf = buf_start, *buf_end = buf_start + len;
+    size_t max_headers = *num_headers;
+    int r;
+
+    *method = NULL;
+    *method_len = 0;
+    *path = NULL;
+    *path_len = 0;
+    *minor_version = -1;
+    *num_headers = 0;
+    if (index != NULL) {
+        for (int i = 0; i != PHR_NUM_KNOWN_HEADERS; ++i)
+            index->first[i] = -1;
+        index->repeated = 0;
+    }
+
+    /* if last_len != 0, check if the request is complete (a fast countermeasure
+       againt slowloris */
+    if (last_len != 0 && is_complete(buf, buf_end, last_len, &r) == NULL) {
+        return r;
+    }
+
+    if ((buf = parse_request(buf, buf_end, method, method_len, path, path_len, minor_version, headers, num_headers, max_headers,
+                             index, &r)) == NULL) {
+        return r;
+    }
+
+    return (int)(buf - buf_start);
+}
+
+int phr_parse_request(const char *buf_start, size_t len, const char **method, size_t *method_len, const char **path,
+                      size_t *path_len, int *minor_version, struct phr_header *headers, size_t *num_headers, size_t last_len)
+{
+    return phr_parse_request_indexed(buf_start, len, method, method_len, path, path_len, minor_version, headers, num_headers,
+                                     last_len, NULL);
+}
+
+static const char *parse_response(const char *buf, const char *buf_end, int *minor_version, int *status, const char **msg,
+                                  size_t *msg_len, struct phr_header *headers, size_t *num_headers, size_t max_headers, int *ret)
+{
+    /* parse "HTTP/1.x" */
+    if ((buf = parse_http_version(buf, buf_end, minor_version, ret)) == NULL) {
+        return NULL;
+    }
+    /* skip space */
+    if (*buf != ' ') {
+        *ret = -1;
+        return NULL;
+    }
+    do {
+        ++buf;
+        CHECK_EOF();
+    } while (*buf == ' ');
+    /* parse status code, we want at least [:digit:][:digit:][:digit:]<other char> to try to parse */
+    if (buf_end - buf < 4) {
+        *ret = -2;
+        return NULL;
+    }
+    PARSE_INT_3(status);
+
+    /* get message including preceding space */
+    if ((buf = get_token_to_eol(buf, buf_end, msg, msg_len, ret)) == NULL) {
+        return NULL;
+    }
+    if (*msg_len == 0) {
+        /* ok */
+    } else if (**msg == ' ') {
+        /* Remove preceding space. Successful return from `get_token_to_eol` guarantees that we would hit something other than SP
+         * before running past the end of the given buffer. */
+        do {
+            ++*msg;
+            --*msg_len;
+        } while (**msg == ' ');
+    } else {
+        /* garbage found after status code */
+        *ret = -1;
+        return NULL;
+    }
+
+    return parse_headers(buf, buf_end, headers, num_headers, max_headers, NULL, ret);
+}
+
+int phr_parse_response(const char *buf_start, size_t len, int *minor_version, int *status, const char **msg, size_t *msg_len,
+                       struct phr_header *headers, size_t *num_headers, size_t last_len)
+{
+    const char *buf = buf_start, *buf_end = buf + len;
+    size_t max_headers = *num_headers;
+    int r;
+
+    *minor_version = -1;
+    *status = 0;
+    *msg = NULL;
+    *msg_len = 0;
+    *num_headers = 0;
+
+    /* if last_len != 0, check if the response is complete (a fast countermeasure
+       against slowloris */
+    if (last_len != 0 && is_complete(buf, buf_end, last_len, &r) == NULL) {
+        return r;
+    }
+
+    if ((buf = parse_response(buf, buf_end, minor_version, status, msg, msg_len, headers, num_headers, max_headers, &r)) == NULL) {
+        return r;
+    }
+
+    return (int)(buf - buf_start);
+}
+
+int phr_parse_headers(const char *buf_start, size_t len, struct phr_header *headers, size_t *num_headers, size_t last_len)
+{
+    const char *buf = buf_start, *buf_end = buf + len;
+    size_t max_headers = *num_headers;
+    int r;
+
+    *num_headers = 0;
+
+    /* if last_len != 0, check if the response is complete (a fast countermeasure
+       against slowloris */
+    if (last_len != 0 && is_complete(buf, buf_end, last_len, &r) == NULL) {
+        return r;
+    }
+
+    if ((buf = parse_headers(buf, buf_end, headers, num_headers, max_headers, NULL, &r)) == NULL) {
+        return r;
+    }
+
+    return (int)(buf - buf_start);
+}
+
+enum {
+    CHUNKED_IN_CHUNK_SIZE,
+    CHUNKED_IN_CHUNK_EXT,
+    CHUNKED_IN_CHUNK_DATA,
+    CHUNKED_IN_CHUNK_CRLF,
+    CHUNKED_IN_TRAILERS_LINE_HEAD,
+    CHUNKED_IN_TRAILERS_LINE_MIDDLE
+};
+
+static int decode_hex(int ch)
+{
+    if ('0' <= ch && ch <= '9') {
+        return ch - '0';
+    } else if ('A' <= ch && ch <= 'F') {
+        return ch - 'A' + 0xa;
+    } else if ('a' <= ch && ch <= 'f') {
+        return ch - 'a' + 0xa;
+    } else {
+        return -1;
+    }
+}
+
+ssize_t phr_decode_chunked(struct phr_chunked_decoder *decoder, char *buf, size_t *_bufsz)
+{
+    size_t dst = 0, src = 0, bufsz = *_bufsz;
+    ssize_t ret = -2; /* incomplete */
+
+    decoder->_total_read += bufsz;
+
+    while (1) {
+        switch (decoder->_state) {
+        case CHUNKED_IN_CHUNK_SIZE:
+            for (;; ++src) {
+                int v;
+                if (src == bufsz)
+                    goto Exit;
+                if ((v = decode_hex(buf[src])) == -1) {
+                    if (decoder->_hex_count == 0) {
+                        ret = -1;
+                        goto Exit;
+                    }
+                    /* the only characters that may appear after the chunk size are BWS, semicolon, or CRLF */
+                    switch (buf[src]) {
+                    case ' ':
+                    case '\011':
+                    case ';':
+                    case '\012':
+                    case '\015':
+                        break;
+                    default:
+                        ret = -1;
+                        goto Exit;
+                    }
+                    break;
+                }
+                if (decoder->_hex_count == sizeof(size_t) * 2) {
+                    ret = -1;
+                    goto Exit;
+                }
+                decoder->bytes_left_in_chunk = decoder->bytes_left_in_chunk * 16 + v;
+                ++decoder->_hex_count;
+            }
+            decoder->_hex_count = 0;
+            decoder->_state = CHUNKED_IN_CHUNK_EXT;
+        /* fallthru */
+        case CHUNKED_IN_CHUNK_EXT:
+            /* RFC 7230 A.2 "Line folding in chunk extensions is disallowed" */
+            for (;; ++src) {
+                if (src == bufsz)
+                    goto Exit;
+                if (buf[src] == '\012')
+                    break;
+            }
+            ++src;
+            if (decoder->bytes_left_in_chunk == 0) {
+                if (decoder->consume_trailer) {
+                    decoder->_state = CHUNKED_IN_TRAILERS_LINE_HEAD;
+                    break;
+                } else {
+                    goto Complete;
+                }
+            }
+            decoder->_state = CHUNKED_IN_CHUNK_DATA;
+        /* fallthru */
+        case CHUNKED_IN_CHUNK_DATA: {
+            size_t avail = bufsz - src;
+            if (avail < decoder->bytes_left_in_chunk) {
+                if (dst != src)
+                    memmove(buf + dst, buf + src, avail);
+                src += avail;
+                dst += avail;
+                decoder->bytes_left_in_chunk -= avail;
+                goto Exit;
+            }
+            if (dst != src)
+                memmove(buf + dst, buf + src, decoder->bytes_left_in_chunk);
+            src += decoder->bytes_left_in_chunk;
+            dst += decoder->bytes_left_in_chunk;
+            decoder->bytes_left_in_chunk = 0;
+            decoder->_state = CHUNKED_IN_CHUNK_CRLF;
+        }
+        /* fallthru */
+        case CHUNKED_IN_CHUNK_CRLF:
+            for (;; ++src) {
+                if (src == bufsz)
+                    goto Exit;
+                if (buf[src] != '\015')
+                    break;
+            }
+            if (buf[src] != '\012') {
+                ret = -1;
+                goto Exit;
+            }
+            ++src;
+            decoder->_state = CHUNKED_IN_CHUNK_SIZE;
+            break;
+        case CHUNKED_IN_TRAILERS_LINE_HEAD:
+            for (;; ++src) {
+                if (src == bufsz)
+                    goto Exit;
+                if (buf[src] != '\015')
+                    break;
+            }
+            if (buf[src++] == '\012')
+                goto Complete;
+            decoder->_state = CHUNKED_IN_TRAILERS_LINE_MIDDLE;
+        /* fallthru */
+        case CHUNKED_IN_TRAILERS_LINE_MIDDLE:
+            for (;; ++src) {
+                if (src == bufsz)
+                    goto Exit;
+                if (buf[src] == '\012')
+                    break;
+            }
+            ++src;
+            decoder->_state = CHUNKED_IN_TRAILERS_LINE_HEAD;
+            break;
+        default:
+            assert(!"decoder is corrupt");
+        }
+    }
+
+Complete:
+    ret = bufsz - src;
+Exit:
+    if (dst != src)
+        memmove(buf + dst, buf + src, bufsz - src);
+    *_bufsz = dst;
+    /* if incomplete but the overhead of the chunked encoding is >=100KB and >80%, signal an error */
+    if (ret == -2) {
+        decoder->_total_overhead += bufsz - dst;
+        if (decoder->_total_overhead >= 100 * 1024 && decoder->_total_read - decoder->_total_overhead < decoder->_total_read / 4)
+            ret = -1;
+    }
+    return ret;
+}
+
+int phr_decode_chunked_is_in_data(struct phr_chunked_decoder *decoder)
+{
+    return decoder->_state == CHUNKED_IN_CHUNK_DATA;
+}
+
+#undef CHECK_EOF
+#undef EXPECT_CHAR
+#undef ADVANCE_TOKEN
@@ -3,6 +3,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -10,6 +13,40 @@
 #include <arpa/inet.h>
 #include "server.h"
 
+/* Spare fd, given up on EMFILE/ENFILE to accept and drop one waiting client */
+static int reserve_fd = -1;
+static bool listening;
+
+static long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* Take the listener out of the epoll set while no more connections can be taken */
+static void set_listening(int epoll_fd, int listen_fd, bool on)
+{
+    if (on == listening)
+        return;
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = listen_fd };
+    epoll_ctl(epoll_fd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, listen_fd, &ev);
+    listening = on;
+}
+
+static void shed_connection(int listen_fd)
+{
+    if (reserve_fd < 0)
+        return;
+
+    close(reserve_fd);
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd >= 0)
+        close(fd);
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
 int main(int argc, char *argv[]) 
 {
     if (argc < 2) {
@@ -24,7 +61,7 @@ int main(int argc, char *argv[])
     char buf[MAX_MESSAGE_LEN];
     memset(buf, 0, sizeof(buf));
 
-    int listen_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
     if (listen_fd < 0) {
         perror("Socket()");
         return 1;
@@ -50,45 +87,80 @@ int main(int argc, char *argv[])
 
     struct epoll_event ev, events[MAX_EVENTS];
     int new_events, conn_fd, epoll_fd;
+    int nr_conns = 0;
+    long backoff_until = 0;
     epoll_fd = epoll_create(MAX_EVENTS);
     if (epoll_fd < 0) {
         perror("Epoll()");
         return 1;
     }
-    ev.events = EPOLLIN;
-    ev.data.fd = listen_fd;
 
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    set_listening(epoll_fd, listen_fd, true);
+    if (!listening) {
         fprintf(stderr, "Error adding new listening socket to epoll\n");
         return 1;
     }
 
     while (true) {
-        new_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        new_events = epoll_wait(epoll_fd, events, MAX_EVENTS, backoff_until ? ACCEPT_BACKOFF_MS : -1);
         if (new_events == -1) {
             perror("Epoll_wait()");
             return 1;
         }
+        if (backoff_until && now_ms() >= backoff_until) {
+            backoff_until = 0;
+            set_listening(epoll_fd, listen_fd, nr_conns < MAX_CONNS);
+        }
         for (int i = 0; i < new_events; i++) {
             if (events[i].data.fd == listen_fd) {
-                conn_fd = accept4(listen_fd, (struct sockaddr *)&client_addr, &client_len, SOCK_NONBLOCK);
-                if (conn_fd == -1) {
-                    fprintf(stderr, "Error accepting new connection\n");
-                    return 1;
-                }
-                ev.events = EPOLLIN | EPOLLET;
-                ev.data.fd = conn_fd;
-                if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn_fd, &ev) == -1) {
-                    fprintf(stderr, "Error adding new event to epoll\n");
-                    return 1;
+                /*
+                 * Drain the backlog, up to a cap so connected clients still
+                 * get served during an accept storm. At the connection limit
+                 * or out of fds the listener is paused instead of being left
+                 * readable, which would spin epoll_wait.
+                 */
+                for (int n = 0; n < MAX_ACCEPTS && listening; n++) {
+                    if (nr_conns >= MAX_CONNS) {
+                        set_listening(epoll_fd, listen_fd, false);
+                        break;
+                    }
+
+                    conn_fd = accept4(listen_fd, (struct sockaddr *)&client_addr, &client_len, SOCK_NONBLOCK);
+                    if (conn_fd == -1) {
+                        int err = errno;
+                        if (err == ECONNABORTED || err == EINTR)
+                            continue;
+                        if (err == EMFILE || err == ENFILE)
+                            shed_connection(listen_fd);
+                        if (err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM) {
+                            set_listening(epoll_fd, listen_fd, false);
+                            backoff_until = now_ms() + ACCEPT_BACKOFF_MS;
+                        } else if (err != EAGAIN) {
+                            perror("Accept()");
+                        }
+                        break;
+                    }
+
+                    ev.events = EPOLLIN | EPOLLET;
+                    ev.data.fd = conn_fd;
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn_fd, &ev) == -1) {
+                        fprintf(stderr, "Error adding new event to epoll\n");
+                        close(conn_fd);
+                        continue;
+                    }
+                    nr_conns++;
                 }
             }else {
                 int new_sock_fd = events[i].data.fd;
                 int recv_sz = recv(new_sock_fd, buf, MAX_MESSAGE_LEN, 0);
-                if (recv_sz <= 0) {
-                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, new_sock_fd, NULL);
-                    shutdown(new_sock_fd, SHUT_RDWR);
-                }else {
+                if (recv_sz == 0 || (recv_sz < 0 && errno != EAGAIN)) {
+                    /* close also drops the socket from the epoll set */
+                    close(new_sock_fd);
+                    nr_conns--;
+                    if (!backoff_until)
+                        set_listening(epoll_fd, listen_fd, nr_conns < MAX_CONNS);
+                }else if (recv_sz > 0) {
                     send(new_sock_fd, buf, recv_sz, 0);
                 }
             }
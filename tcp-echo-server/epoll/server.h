@@ -4,5 +4,10 @@
 #define BACK_LOG 512
 #define MAX_MESSAGE_LEN 2048
 #define MAX_EVENTS 128
+#define MAX_CONNS 8192
+/* Connections taken off the listener per readiness event */
+#define MAX_ACCEPTS 64
+/* How long the listener stays paused after running out of fds, in ms */
+#define ACCEPT_BACKOFF_MS 100
 
 #endif
\ No newline at end of file
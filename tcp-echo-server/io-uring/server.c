@@ -57,14 +57,63 @@ void add_send(struct io_uring *ring, int fd, size_t msg_size, unsigned int flags
     return;
 }
 
+// setup flags of the low-overhead profile, dropped in this order when the kernel rejects them
+static const unsigned profile_flags[] = {
+    IORING_SETUP_DEFER_TASKRUN,
+    IORING_SETUP_SINGLE_ISSUER,
+    IORING_SETUP_COOP_TASKRUN,
+};
+
+static int queue_init_fallback(unsigned entries, struct io_uring *ring, struct io_uring_params *params)
+{
+    int ret = io_uring_queue_init_params(entries, ring, params);
+
+    for (size_t i = 0; ret == -EINVAL && i < sizeof(profile_flags) / sizeof(profile_flags[0]); i++) {
+        if (!(params->flags & profile_flags[i]))
+            continue;
+        params->flags &= ~profile_flags[i];
+        ret = io_uring_queue_init_params(entries, ring, params);
+    }
+    return ret;
+}
+
+static void usage(void)
+{
+    printf("usage: ./server [-P [-C sq_thread_cpu] [-I sq_thread_idle_ms]] [-L] [port]\n");
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc < 2) {
-        printf("usage: ./server [port]\n");
+    bool sqpoll = false, low_overhead = false;
+    int sq_thread_cpu = -1, sq_thread_idle = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "PC:I:L")) != -1) {
+        switch (opt) {
+        case 'P':
+            sqpoll = true;
+            break;
+        case 'C':
+            sq_thread_cpu = atoi(optarg);
+            break;
+        case 'I':
+            sq_thread_idle = atoi(optarg);
+            break;
+        case 'L':
+            low_overhead = true;
+            break;
+        default:
+            usage();
+            return 0;
+        }
+    }
+
+    if (optind >= argc) {
+        usage();
         return 0;
     }
 
-    uint32_t port = (uint32_t)strtol(argv[1], NULL, 10);
+    uint32_t port = (uint32_t)strtol(argv[optind], NULL, 10);
     struct sockaddr_in server_addr, client_addr;
     socklen_t client_len = sizeof(client_addr);
 
@@ -100,10 +149,39 @@ int main(int argc, char *argv[])
 
     memset(&params, 0, sizeof(params));
 
-    if (io_uring_queue_init_params(4096, &ring, &params) < 0) {
+    // optionally let a kernel thread poll the SQ so submitting needs no syscall
+    if (sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = sq_thread_idle;
+        if (sq_thread_cpu >= 0) {
+            params.flags |= IORING_SETUP_SQ_AFF;
+            params.sq_thread_cpu = sq_thread_cpu;
+        }
+        printf("using SQPOLL: cpu %d, idle %d ms\n", sq_thread_cpu, sq_thread_idle);
+    }
+
+    // low-overhead profile: task_work only runs when we wait for completions,
+    // SQPOLL rings only accept SINGLE_ISSUER out of it
+    if (low_overhead) {
+        params.flags |= IORING_SETUP_SINGLE_ISSUER;
+        if (!sqpoll)
+            params.flags |= IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_COOP_TASKRUN;
+    }
+
+    if (queue_init_fallback(4096, &ring, &params) < 0) {
         perror("io_uring_queue_init_params()");
         return 1;
     }
+
+    // registering the ring fd saves a fd lookup on every io_uring_enter
+    if (low_overhead) {
+        bool registered = io_uring_register_ring_fd(&ring) == 1;
+        printf("ring profile:%s%s%s%s\n",
+               params.flags & IORING_SETUP_SINGLE_ISSUER ? " SINGLE_ISSUER" : "",
+               params.flags & IORING_SETUP_DEFER_TASKRUN ? " DEFER_TASKRUN" : "",
+               params.flags & IORING_SETUP_COOP_TASKRUN ? " COOP_TASKRUN" : "",
+               registered ? " registered-ring-fd" : "");
+    }
     
     // check if IORING_FEAT_FAST_POLL is supported
     if (!(params.features & IORING_FEAT_FAST_POLL)) {